@@ -0,0 +1,344 @@
+// sph_bench: headless simulation benchmark.
+//
+// Runs the simulation without a window - on an EGL surfaceless context
+// (e.g. Mesa llvmpipe on hosts without a GPU) or on the CPU backend - over
+// the GUI's particle-count presets, and prints per-pass times, steps per
+// second and particle updates per second as JSON.
+//
+//   sph_bench [--cpu] [--threads N] [--warmup N] [--steps N]
+//             [--counts 16384,65536,...] [--out results.json]
+//             [--neighbor-cells] [--tiled] [--three-pass-scan]
+//             [--shared-count] [--deterministic] [--morton] [--sparse]
+//             [--fit-grid] [--box-local-grid] [--neighbor-lists] [--compact]
+//             [--fused-count] [--adaptive-dt] [--stats] [--no-shader-cache]
+//
+// --neighbor-cells walks 27 single cells instead of 9 x-row ranges;
+// --tiled stages each block's neighbor rows through shared memory;
+// --three-pass-scan uses scan_blocks/sums/add instead of the look-back scan;
+// --shared-count aggregates the count pass per workgroup (count_shared);
+// --deterministic orders each cell's particles by index (reproducible runs);
+// --morton numbers the grid cells in Morton order instead of row-major;
+// --sparse gives cell table entries only to occupied 8^3-cell bricks;
+// --fit-grid grids only the cells around the fluid's latest bounds;
+// --box-local-grid bins particles in the box's own frame;
+// --neighbor-lists loops over Verlet neighbor lists, rebuilt as needed;
+// --compact stores positions/velocities in 8 bytes each (GPU backend only);
+// --fused-count runs external forces and counting as one pass;
+// --adaptive-dt picks each step's dt from the CFL bound;
+// --stats collects fluid statistics every step;
+// --no-shader-cache compiles every program instead of loading binaries.
+
+#include <GL/glew.h>
+#ifdef SPH_HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cpu_simulation.h"
+#include "shader.h"
+#include "simulation.h"
+#include "utilities.h"
+
+namespace {
+
+struct Options {
+  bool cpu = false;
+  int threads = 0;
+  int warmupSteps = 20;
+  int steps = 200;
+  std::vector<int> counts;
+  std::string outPath;
+};
+
+void printUsage() {
+  std::cerr << "usage: sph_bench [--cpu] [--threads N] [--warmup N] "
+               "[--steps N] [--counts a,b,...] [--out file] "
+               "[--neighbor-cells] [--tiled] [--three-pass-scan] "
+               "[--shared-count] [--deterministic] [--morton] [--sparse] "
+               "[--fit-grid] [--box-local-grid] [--neighbor-lists] [--compact] "
+               "[--fused-count] [--adaptive-dt] [--stats] [--no-shader-cache]"
+            << std::endl;
+}
+
+bool parseOptions(int argc, char **argv, Options &options) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--cpu") {
+      options.cpu = true;
+    } else if (arg == "--threads" && hasValue) {
+      options.threads = std::atoi(argv[++i]);
+    } else if (arg == "--warmup" && hasValue) {
+      options.warmupSteps = std::atoi(argv[++i]);
+    } else if (arg == "--steps" && hasValue) {
+      options.steps = std::atoi(argv[++i]);
+    } else if (arg == "--counts" && hasValue) {
+      std::stringstream list(argv[++i]);
+      std::string item;
+      while (std::getline(list, item, ','))
+        options.counts.push_back(std::atoi(item.c_str()));
+    } else if (arg == "--out" && hasValue) {
+      options.outPath = argv[++i];
+    } else if (arg == "--neighbor-cells") {
+      neighborRowRanges = false;
+    } else if (arg == "--tiled") {
+      tiledNeighborGather = true;
+    } else if (arg == "--three-pass-scan") {
+      singlePassScan = false;
+    } else if (arg == "--shared-count") {
+      sharedCountHistogram = true;
+    } else if (arg == "--deterministic") {
+      deterministicScatter = true;
+    } else if (arg == "--morton") {
+      mortonCellOrder = true;
+    } else if (arg == "--sparse") {
+      sparseBrickGrid = true;
+    } else if (arg == "--fit-grid") {
+      fittedGrid = true;
+    } else if (arg == "--box-local-grid") {
+      boxLocalGrid = true;
+    } else if (arg == "--neighbor-lists") {
+      neighborLists = true;
+    } else if (arg == "--compact") {
+      compactParticles = true;
+    } else if (arg == "--fused-count") {
+      fusedExternalCount = true;
+    } else if (arg == "--adaptive-dt") {
+      adaptiveTimestep = true;
+    } else if (arg == "--stats") {
+      fluidStatistics = true;
+    } else if (arg == "--no-shader-cache") {
+      programBinaryCache = false;
+    } else {
+      return false;
+    }
+  }
+  if (options.counts.empty())
+    options.counts.assign(particleCountPresets,
+                          particleCountPresets + NUM_PARTICLE_COUNT_PRESETS);
+  return options.steps > 0;
+}
+
+// GL 4.3 core context with no surface at all. Prefers the surfaceless
+// platform (no X/Wayland needed), falling back to the default display.
+bool createHeadlessContext() {
+#ifdef SPH_HAVE_EGL
+  EGLDisplay display = EGL_NO_DISPLAY;
+  auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+      "eglGetPlatformDisplayEXT");
+  if (getPlatformDisplay)
+    display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                 EGL_DEFAULT_DISPLAY, nullptr);
+  if (display == EGL_NO_DISPLAY)
+    display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr))
+    return false;
+  if (!eglBindAPI(EGL_OPENGL_API))
+    return false;
+
+  const EGLint configAttribs[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+                                  EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+                                  EGL_NONE};
+  EGLConfig config;
+  EGLint numConfigs = 0;
+  if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) ||
+      numConfigs == 0)
+    return false;
+
+  const EGLint contextAttribs[] = {EGL_CONTEXT_MAJOR_VERSION,
+                                   4,
+                                   EGL_CONTEXT_MINOR_VERSION,
+                                   3,
+                                   EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                                   EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                   EGL_NONE};
+  EGLContext context =
+      eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+  if (context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    return false;
+
+  // GLX builds of GLEW report the missing X display only after the GL entry
+  // points have been loaded, which is all we need here
+  glewExperimental = GL_TRUE;
+  GLenum err = glewInit();
+  return err == GLEW_OK || err == GLEW_ERROR_NO_GLX_DISPLAY;
+#else
+  return false;
+#endif
+}
+
+struct RunResult {
+  int particles;
+  double seconds;
+  double passMs[GPU_PASS_COUNT];
+  double simulatedSeconds; // differs from steps * deltaTime with --adaptive-dt
+  FluidStats stats;        // latest readback at the end of the run (--stats)
+};
+
+// Resets the particles, runs the warmup steps, then times `steps` steps.
+// Pass times are averaged over the timed steps (on the GPU backend each
+// sample is the latest finished step, one or more steps behind).
+RunResult runBenchmark(SimulationBackend &simulation, bool gpu,
+                       ParticleBuffers &buffers, const Options &options,
+                       int count) {
+  numParticles = pendingNumParticles = count;
+  simDeltaTime = fixedDeltaTime;
+  fluidStats = FluidStats{};
+  if (gpu)
+    createParticleBuffers(&buffers);
+  simulation.resetParticles();
+
+  for (int i = 0; i < options.warmupSteps; i++)
+    simulation.step();
+  if (gpu)
+    glFinish();
+
+  RunResult result{count, 0.0, {}, 0.0, {}};
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < options.steps; i++) {
+    result.simulatedSeconds += simDeltaTime;
+    simulation.step();
+    for (int pass = 0; pass < GPU_PASS_COUNT; pass++)
+      result.passMs[pass] += gpuPassMs[pass];
+  }
+  if (gpu)
+    glFinish();
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  for (double &ms : result.passMs)
+    ms /= options.steps;
+  result.stats = fluidStats;
+
+  if (gpu)
+    deleteParticleBuffers(&buffers);
+  return result;
+}
+
+void writeJson(std::ostream &out, const std::string &backend,
+               const std::string &device, const Options &options,
+               const std::vector<RunResult> &results) {
+  out << "{\n";
+  out << "  \"backend\": \"" << backend << "\",\n";
+  out << "  \"device\": \"" << device << "\",\n";
+  out << "  \"deltaTime\": " << fixedDeltaTime << ",\n";
+  out << "  \"adaptiveTimestep\": " << (adaptiveTimestep ? "true" : "false")
+      << ",\n";
+  out << "  \"warmupSteps\": " << options.warmupSteps << ",\n";
+  out << "  \"steps\": " << options.steps << ",\n";
+  out << "  \"neighborWalk\": \"" << (neighborRowRanges ? "rows" : "cells")
+      << "\",\n";
+  out << "  \"tiledGather\": " << (tiledNeighborGather ? "true" : "false")
+      << ",\n";
+  out << "  \"scan\": \"" << (singlePassScan ? "single-pass" : "three-pass")
+      << "\",\n";
+  out << "  \"count\": \"" << (sharedCountHistogram ? "shared" : "global")
+      << "\",\n";
+  out << "  \"deterministic\": " << (deterministicScatter ? "true" : "false")
+      << ",\n";
+  out << "  \"cellOrder\": \"" << (mortonCellOrder ? "morton" : "row-major")
+      << "\",\n";
+  out << "  \"grid\": \"" << (sparseBrickGrid ? "sparse" : "dense") << "\",\n";
+  out << "  \"fittedGrid\": " << (fittedGrid ? "true" : "false") << ",\n";
+  out << "  \"boxLocalGrid\": " << (boxLocalGrid ? "true" : "false") << ",\n";
+  out << "  \"neighborLists\": " << (neighborLists ? "true" : "false")
+      << ",\n";
+  out << "  \"compactParticles\": " << (compactParticles ? "true" : "false")
+      << ",\n";
+  out << "  \"fusedExternalCount\": "
+      << (fusedExternalCount ? "true" : "false") << ",\n";
+  out << "  \"runs\": [\n";
+  for (size_t r = 0; r < results.size(); r++) {
+    const RunResult &run = results[r];
+    double stepsPerSecond = options.steps / run.seconds;
+    double totalMs = 0.0;
+    out << "    {\n";
+    out << "      \"particles\": " << run.particles << ",\n";
+    out << "      \"seconds\": " << run.seconds << ",\n";
+    out << "      \"stepsPerSecond\": " << stepsPerSecond << ",\n";
+    out << "      \"simulatedSeconds\": " << run.simulatedSeconds << ",\n";
+    out << "      \"particleUpdatesPerSecond\": "
+        << stepsPerSecond * run.particles << ",\n";
+    out << "      \"passMs\": {";
+    for (int pass = 0; pass < GPU_PASS_COUNT; pass++) {
+      out << (pass ? ", " : "") << "\"" << gpuPassNames[pass]
+          << "\": " << run.passMs[pass];
+      totalMs += run.passMs[pass];
+    }
+    out << "},\n";
+    if (run.stats.valid) {
+      const FluidStats &s = run.stats;
+      out << "      \"stats\": {\"maxSpeed\": " << s.maxSpeed
+          << ", \"maxAcceleration\": " << s.maxAcceleration
+          << ", \"kineticEnergy\": " << s.kineticEnergy
+          << ", \"meanDensityError\": " << s.meanDensityError
+          << ", \"maxDensityError\": " << s.maxDensityError
+          << ", \"boundsMin\": [" << s.boundsMin.x << ", " << s.boundsMin.y
+          << ", " << s.boundsMin.z << "], \"boundsMax\": [" << s.boundsMax.x
+          << ", " << s.boundsMax.y << ", " << s.boundsMax.z << "]},\n";
+    }
+    out << "      \"totalPassMs\": " << totalMs << "\n";
+    out << "    }" << (r + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n";
+  out << "}\n";
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    printUsage();
+    return 1;
+  }
+
+  bool gpu = !options.cpu;
+  if (gpu && !createHeadlessContext()) {
+    std::cerr << "No headless GL 4.3 context available, using the CPU backend"
+              << std::endl;
+    gpu = false;
+  }
+  compactParticles = compactParticles && gpu;
+
+  ParticleBuffers particleBuffers{};
+  std::unique_ptr<SimulationBackend> simulation;
+  std::string device;
+  if (gpu) {
+    simulation = std::make_unique<GpuSimulation>();
+    device = (const char *)glGetString(GL_RENDERER);
+  } else {
+    auto cpu = std::make_unique<CpuSimulation>(nullptr, options.threads);
+    device = std::to_string(cpu->threadCount()) + " threads";
+    simulation = std::move(cpu);
+  }
+
+  std::vector<RunResult> results;
+  for (int count : options.counts) {
+    std::cerr << simulation->name() << " " << count << " particles..."
+              << std::endl;
+    results.push_back(
+        runBenchmark(*simulation, gpu, particleBuffers, options, count));
+  }
+  simulation.reset();
+
+  const char *backend = gpu ? "GPU" : "CPU";
+  if (options.outPath.empty()) {
+    writeJson(std::cout, backend, device, options, results);
+  } else {
+    std::ofstream out(options.outPath);
+    writeJson(out, backend, device, options, results);
+  }
+  return 0;
+}
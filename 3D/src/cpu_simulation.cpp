@@ -0,0 +1,473 @@
+#include "cpu_simulation.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+// parallelFor chunk sizes: large enough to amortize the shared chunk
+// counter, small enough to balance uneven neighbor counts across threads
+const int PARTICLE_GRAIN = 1024;
+const int CELL_GRAIN = 16384;
+
+const float collisionDamping = 0.2f;
+
+// Same as common.glsl
+glm::ivec3 GetCellCoord(const glm::vec4 &pos, const StepParams &p) {
+  glm::vec3 cell = glm::floor((glm::vec3(pos) - p.gridMin) / smoothingRadius);
+  cell = glm::clamp(cell, glm::vec3(0.0f), glm::vec3(p.gridDims - 1));
+  return glm::ivec3(cell);
+}
+
+uint32_t GetFlatCellIndex(const glm::ivec3 &cellCoord, const StepParams &p) {
+  if (p.mortonOrder)
+    return MortonCellIndex(cellCoord);
+  return (uint32_t)(cellCoord.x +
+                    p.gridDims.x * (cellCoord.y + p.gridDims.y * cellCoord.z));
+}
+
+// Calls visit(start, end) for every sorted-index range of the 3x3x3 cell
+// block around cellCoord, like GetNeighborRange in neighbors.glsl: 9
+// contiguous x-rows, or 27 single cells
+template <typename Visit>
+void ForEachNeighborRange(const glm::ivec3 &cellCoord, const StepParams &p,
+                          const uint32_t *cellStart,
+                          const std::atomic<uint32_t> *cellEnd, Visit &&visit) {
+  const glm::ivec3 &gridDims = p.gridDims;
+  int x0 = std::max(cellCoord.x - 1, 0);
+  int x1 = std::min(cellCoord.x + 1, gridDims.x - 1);
+  for (int dz = -1; dz <= 1; ++dz) {
+    for (int dy = -1; dy <= 1; ++dy) {
+      int y = cellCoord.y + dy;
+      int z = cellCoord.z + dz;
+      if (y < 0 || z < 0 || y >= gridDims.y || z >= gridDims.z)
+        continue;
+      if (p.rowRanges) {
+        uint32_t first = GetFlatCellIndex(glm::ivec3(x0, y, z), p);
+        uint32_t last = GetFlatCellIndex(glm::ivec3(x1, y, z), p);
+        visit(cellStart[first], cellEnd[last].load(std::memory_order_relaxed));
+      } else {
+        for (int x = x0; x <= x1; x++) {
+          uint32_t cell = GetFlatCellIndex(glm::ivec3(x, y, z), p);
+          visit(cellStart[cell], cellEnd[cell].load(std::memory_order_relaxed));
+        }
+      }
+    }
+  }
+}
+
+// Reflects one box-local axis off the bot/top faces, as in update.compute
+void Collide(float &pos, float &vel, float bot, float top) {
+  if (pos <= bot) {
+    pos = bot + (bot - pos);
+    vel = std::abs(vel) * collisionDamping;
+  } else if (pos >= top) {
+    pos = top - (pos - top);
+    vel = -std::abs(vel) * collisionDamping;
+  }
+}
+
+// Runs one pass and records its wall-clock time in gpuPassMs
+template <typename Body> void timePass(int pass, Body &&body) {
+  auto start = std::chrono::steady_clock::now();
+  body();
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  gpuPassMs[pass] = elapsed.count();
+}
+
+} // namespace
+
+// Persistent worker threads. parallelFor hands out fixed-size chunks of an
+// index range through a shared counter; the calling thread works too, and
+// returns once every chunk is done (which also publishes the workers'
+// writes to it).
+class CpuSimulation::WorkerPool {
+public:
+  explicit WorkerPool(int numThreads) {
+    for (int i = 1; i < numThreads; i++)
+      workers.emplace_back([this] { workerLoop(); });
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers)
+      worker.join();
+  }
+
+  int size() const { return (int)workers.size() + 1; }
+
+  void parallelFor(int count, int grain,
+                   const std::function<void(int, int)> &fn) {
+    if (workers.empty() || count <= grain) {
+      fn(0, count);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = &fn;
+      jobCount = count;
+      jobGrain = grain;
+      nextChunk = 0;
+      busyWorkers = (int)workers.size();
+      generation++;
+    }
+    wake.notify_all();
+    runChunks();
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this] { return busyWorkers == 0; });
+  }
+
+private:
+  void runChunks() {
+    for (;;) {
+      int begin = nextChunk.fetch_add(jobGrain);
+      if (begin >= jobCount)
+        return;
+      (*job)(begin, std::min(begin + jobGrain, jobCount));
+    }
+  }
+
+  void workerLoop() {
+    long seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&] { return quit || generation != seen; });
+        if (quit)
+          return;
+        seen = generation;
+      }
+      runChunks();
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--busyWorkers == 0)
+        finished.notify_one();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake, finished;
+  bool quit = false;
+  long generation = 0;
+  int busyWorkers = 0;
+
+  const std::function<void(int, int)> *job = nullptr;
+  int jobCount = 0, jobGrain = 1;
+  std::atomic<int> nextChunk{0};
+};
+
+CpuSimulation::CpuSimulation(const ParticleBuffers *buffers, int numThreads)
+    : buffers(buffers) {
+  if (numThreads <= 0)
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  pool = std::make_unique<WorkerPool>(numThreads);
+}
+
+CpuSimulation::~CpuSimulation() = default;
+
+int CpuSimulation::threadCount() const { return pool->size(); }
+
+void CpuSimulation::parallelFor(int count,
+                                const std::function<void(int, int)> &fn) {
+  pool->parallelFor(count, PARTICLE_GRAIN, fn);
+}
+
+void CpuSimulation::resetParticles() {
+  size_t n = numParticles;
+  positions.assign(n, glm::vec4(0.0f));
+  velocities.assign(n, glm::vec4(0.0f));
+  densities.assign(n, 0.0f);
+  nearDensities.assign(n, 0.0f);
+  cellIndices.resize(n);
+  cellRanks.resize(n);
+  cellParticleIds.resize(n);
+  sortedPredicted.resize(n);
+  sortedPositions.resize(n);
+  sortedVelocities.resize(n);
+
+  if (buffers) {
+    // Start from exactly what the GPU backend would have started from
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers->positions);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, n * sizeof(glm::vec4),
+                       positions.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers->velocities);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, n * sizeof(glm::vec4),
+                       velocities.data());
+  } else {
+    for (size_t i = 0; i < n; i++)
+      positions[i] = genRandomVector3d();
+  }
+  predicted = positions;
+}
+
+void CpuSimulation::uploadToBuffers() {
+  GLsizeiptr size = numParticles * sizeof(glm::vec4);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers->positions);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, positions.data());
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers->velocities);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, velocities.data());
+}
+
+void CpuSimulation::step() {
+  if (!running)
+    return;
+
+  const int n = numParticles;
+  const float dt = simDeltaTime;
+  const float h = smoothingRadius;
+  StepParams p = computeStepParams();
+  if (p.cellCount > cellCapacity) {
+    cellCapacity = p.cellCount + p.cellCount / 2;
+    cellStart.reset(new uint32_t[cellCapacity]);
+    cellEnd.reset(new std::atomic<uint32_t>[cellCapacity]);
+  }
+
+  glm::vec4 gravityAccel(0.0f, -gravity / 100.0f, 0.0f, 0.0f);
+  auto clearCounts = [&] {
+    pool->parallelFor(p.cellCount, CELL_GRAIN, [&](int begin, int end) {
+      for (int cell = begin; cell < end; cell++)
+        cellEnd[cell].store(0, std::memory_order_relaxed);
+    });
+  };
+
+  // Fused variant, as external_count.compute: one sweep over the particles,
+  // timed as External
+  if (fusedExternalCount) {
+    timePass(GPU_PASS_EXTERNAL, [&] {
+      clearCounts();
+      parallelFor(n, [&](int begin, int end) {
+        for (int id = begin; id < end; id++) {
+          velocities[id] += gravityAccel * dt;
+          predicted[id] = positions[id] + velocities[id] * dt;
+          uint32_t cell = GetFlatCellIndex(GetCellCoord(predicted[id], p), p);
+          cellIndices[id] = cell;
+          cellRanks[id] = cellEnd[cell].fetch_add(1, std::memory_order_relaxed);
+        }
+      });
+    });
+    gpuPassMs[GPU_PASS_COUNTING] = 0.0;
+  } else {
+    // External forces (gravity) + predicted positions
+    timePass(GPU_PASS_EXTERNAL, [&] {
+      parallelFor(n, [&](int begin, int end) {
+        for (int id = begin; id < end; id++) {
+          velocities[id] += gravityAccel * dt;
+          predicted[id] = positions[id] + velocities[id] * dt;
+        }
+      });
+    });
+
+    // Count particles per cell (cellEnd doubles as the histogram)
+    timePass(GPU_PASS_COUNTING, [&] {
+      clearCounts();
+      parallelFor(n, [&](int begin, int end) {
+        if (!sharedCountHistogram) {
+          for (int id = begin; id < end; id++) {
+            uint32_t cell = GetFlatCellIndex(GetCellCoord(predicted[id], p), p);
+            cellIndices[id] = cell;
+            cellRanks[id] =
+                cellEnd[cell].fetch_add(1, std::memory_order_relaxed);
+          }
+          return;
+        }
+        // CPU counterpart of count_shared: particles are still in last step's
+        // cell order, so merge runs of equal cells into one atomic each
+        auto flushRun = [&](int runBegin, int runEnd) {
+          uint32_t base = cellEnd[cellIndices[runBegin]].fetch_add(
+              runEnd - runBegin, std::memory_order_relaxed);
+          for (int id = runBegin; id < runEnd; id++)
+            cellRanks[id] = base + (id - runBegin);
+        };
+        int runBegin = begin;
+        for (int id = begin; id < end; id++) {
+          uint32_t cell = GetFlatCellIndex(GetCellCoord(predicted[id], p), p);
+          cellIndices[id] = cell;
+          if (id > runBegin && cell != cellIndices[runBegin]) {
+            flushRun(runBegin, id);
+            runBegin = id;
+          }
+        }
+        if (end > runBegin)
+          flushRun(runBegin, end);
+      });
+    });
+  }
+
+  // Exclusive prefix sum of the counts -> cellStart, and cellEnd becomes
+  // cellStart + count. Two levels like the GPU scan: one block of cells per
+  // thread, then a serial scan of the (few) block sums.
+  timePass(GPU_PASS_SCAN, [&] {
+    int numBlocks = threadCount();
+    int blockSize = (p.cellCount + numBlocks - 1) / numBlocks;
+    std::vector<uint32_t> blockSums(numBlocks, 0);
+    pool->parallelFor(numBlocks, 1, [&](int begin, int end) {
+      for (int block = begin; block < end; block++) {
+        int last = std::min(p.cellCount, (block + 1) * blockSize);
+        uint32_t sum = 0;
+        for (int cell = block * blockSize; cell < last; cell++)
+          sum += cellEnd[cell].load(std::memory_order_relaxed);
+        blockSums[block] = sum;
+      }
+    });
+    uint32_t carry = 0;
+    for (uint32_t &sum : blockSums) {
+      uint32_t blockTotal = sum;
+      sum = carry;
+      carry += blockTotal;
+    }
+    pool->parallelFor(numBlocks, 1, [&](int begin, int end) {
+      for (int block = begin; block < end; block++) {
+        int last = std::min(p.cellCount, (block + 1) * blockSize);
+        uint32_t start = blockSums[block];
+        for (int cell = block * blockSize; cell < last; cell++) {
+          uint32_t count = cellEnd[cell].load(std::memory_order_relaxed);
+          cellStart[cell] = start;
+          start += count;
+          cellEnd[cell].store(start, std::memory_order_relaxed);
+        }
+      }
+    });
+  });
+
+  // Scatter into cell order at cellStart + rank. The deterministic variant
+  // ranks by index within the cell instead (cell_ids + scatter stableOrder).
+  timePass(GPU_PASS_SCATTER, [&] {
+    if (deterministicScatter) {
+      parallelFor(n, [&](int begin, int end) {
+        for (int id = begin; id < end; id++)
+          cellParticleIds[cellStart[cellIndices[id]] + cellRanks[id]] = id;
+      });
+    }
+    parallelFor(n, [&](int begin, int end) {
+      for (int id = begin; id < end; id++) {
+        uint32_t cell = cellIndices[id];
+        uint32_t start = cellStart[cell];
+        uint32_t rank = cellRanks[id];
+        if (deterministicScatter) {
+          uint32_t cellEndIndex = cellEnd[cell].load(std::memory_order_relaxed);
+          rank = 0;
+          for (uint32_t j = start; j < cellEndIndex; j++)
+            rank += cellParticleIds[j] < (uint32_t)id;
+        }
+        uint32_t dst = start + rank;
+        sortedPredicted[dst] = predicted[id];
+        sortedPositions[dst] = positions[id];
+        sortedVelocities[dst] = velocities[id];
+      }
+    });
+  });
+
+  // Density + near density (sorted space)
+  timePass(GPU_PASS_DENSITY, [&] {
+    parallelFor(n, [&](int begin, int end) {
+      for (int id = begin; id < end; id++) {
+        glm::vec4 pos = sortedPredicted[id];
+        float density = 0.0f;
+        float nearDensity = 0.0f;
+        glm::ivec3 cellCoord = GetCellCoord(pos, p);
+
+        ForEachNeighborRange(
+            cellCoord, p, cellStart.get(), cellEnd.get(),
+            [&](uint32_t start, uint32_t end) {
+              for (uint32_t nb = start; nb < end; nb++) {
+                float dst = glm::length(glm::vec3(sortedPredicted[nb] - pos));
+                if (dst < h) {
+                  float v = h - dst;
+                  density += v * v * p.spikyPow2Scale;
+                  nearDensity += v * v * v * p.spikyPow3Scale;
+                }
+              }
+            });
+
+        densities[id] = density;
+        nearDensities[id] = nearDensity;
+      }
+    });
+  });
+
+  // Pressure + near-pressure + viscosity forces, integration, collisions.
+  // Results land at the sorted index, like update.compute.
+  timePass(GPU_PASS_UPDATE, [&] {
+    const glm::mat4 toWorld = boxTransform;
+    const glm::mat4 toLocal = boxTransformInverse;
+    parallelFor(n, [&](int begin, int end) {
+      for (int id = begin; id < end; id++) {
+        glm::vec4 pos = sortedPositions[id];
+        glm::vec4 vel = sortedVelocities[id];
+        glm::vec4 pred = sortedPredicted[id];
+        float density = densities[id];
+        float nearDensity = nearDensities[id];
+        float pressure = (density - p.targetDensityEff) * p.pressureStrengthEff;
+
+        glm::vec4 pressureForce(0.0f);
+        glm::vec4 viscosityForce(0.0f);
+        glm::ivec3 cellCoord = GetCellCoord(pred, p);
+
+        ForEachNeighborRange(
+            cellCoord, p, cellStart.get(), cellEnd.get(),
+            [&](uint32_t start, uint32_t end) {
+              for (uint32_t nb = start; nb < end; nb++) {
+                if (nb == (uint32_t)id)
+                  continue; // self
+
+                glm::vec3 offset = glm::vec3(sortedPredicted[nb] - pred);
+                float dst = glm::length(offset);
+                if (dst < h && dst > 0.0001f) {
+                  glm::vec4 dir(glm::normalize(offset), 0.0f);
+                  float densityB = densities[nb];
+                  float nearDensityB = nearDensities[nb];
+
+                  float pressureB =
+                      (densityB - p.targetDensityEff) * p.pressureStrengthEff;
+                  float sharedPressure = (pressureB + pressure) * 0.5f;
+                  float sharedNearPressure =
+                      (nearDensityB + nearDensity) * 0.5f *
+                      nearPressureStrength;
+
+                  float v = h - dst;
+                  pressureForce +=
+                      dir * (v * p.spikyPow2DerivScale * sharedPressure /
+                                 densityB +
+                             v * v * p.spikyPow3DerivScale *
+                                 sharedNearPressure / nearDensityB);
+
+                  float w = h * h - dst * dst;
+                  viscosityForce += (sortedVelocities[nb] - vel) *
+                                    (w * w * w * p.poly6Scale / densityB);
+                }
+              }
+            });
+
+        vel += (pressureForce / density) * dt +
+               viscosityForce * p.viscosityStrengthEff * dt;
+
+        pos += glm::vec4(glm::vec3(vel) * dt, 0.0f);
+        pos.w = 1.0f;
+
+        // Box collision in the box's local space
+        glm::vec4 localPos = toLocal * pos;
+        glm::vec4 localVel = toLocal * vel;
+        Collide(localPos.x, localVel.x, botX, topX);
+        Collide(localPos.y, localVel.y, botY, topY);
+        Collide(localPos.z, localVel.z, botZ, topZ);
+        pos = toWorld * localPos;
+        vel = toWorld * localVel;
+        vel.w = 0.0f;
+
+        positions[id] = pos;
+        velocities[id] = vel;
+      }
+    });
+  });
+
+  if (buffers)
+    uploadToBuffers();
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "simulation.h"
+#include "utilities.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Multithreaded CPU backend. Runs the same passes as runSimulationFrame
+// (external, count, scan, scatter, density, update) on host copies of the
+// ParticleBuffers, with the same grid, kernels and box collision, split
+// across all cores.
+//
+// Constructed without buffers it needs no GL context at all (headless hosts);
+// with buffers it starts from their contents on resetParticles and uploads
+// positions/velocities after every step so the renderer draws the CPU state.
+class CpuSimulation : public SimulationBackend {
+public:
+  // numThreads <= 0 uses every hardware thread
+  explicit CpuSimulation(const ParticleBuffers *buffers = nullptr,
+                         int numThreads = 0);
+  ~CpuSimulation() override;
+
+  const char *name() const override { return "CPU"; }
+  void resetParticles() override;
+  void step() override;
+  int threadCount() const;
+
+  // Per-particle state, same meaning and ordering as the SSBOs of the same
+  // name (positions/velocities end each step in cell-sorted order)
+  std::vector<glm::vec4> positions, velocities, predicted;
+  std::vector<glm::vec4> sortedPredicted, sortedPositions, sortedVelocities;
+  std::vector<float> densities, nearDensities;
+  std::vector<uint32_t> cellIndices, cellRanks, cellParticleIds;
+
+private:
+  class WorkerPool;
+
+  void parallelFor(int count, const std::function<void(int, int)> &fn);
+  void uploadToBuffers();
+
+  const ParticleBuffers *buffers;
+  std::unique_ptr<WorkerPool> pool;
+
+  // Per-cell tables, as in simulation.cpp: cellEnd holds the counts, then
+  // the cell ends
+  int cellCapacity = 0;
+  std::unique_ptr<uint32_t[]> cellStart;
+  std::unique_ptr<std::atomic<uint32_t>[]> cellEnd;
+};
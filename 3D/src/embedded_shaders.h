@@ -0,0 +1,8 @@
+#pragma once
+#include <string>
+
+// Shader sources compiled into the binaries, with their #includes expanded.
+// Generated at build time by tools/embed_shaders.cpp from src/shaders, so the
+// executables need no shader files at runtime. Returns nullptr for a path (as
+// in shader.h) that was not embedded.
+const char *embeddedShaderSource(const std::string &path);
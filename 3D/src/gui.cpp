@@ -1,4 +1,5 @@
 #include "gui.h"
+#include "sim_thread.h"
 
 void setupGUI(GLFWwindow *window) {
   ImGui::CreateContext();
@@ -6,54 +7,108 @@ void setupGUI(GLFWwindow *window) {
   ImGui_ImplOpenGL3_Init("#version 430");
 }
 
-void renderGUI() {
+void renderGUI(SimulationSettings &settings,
+               const SimulationReadout &readout) {
   ImGui_ImplOpenGL3_NewFrame();
   ImGui_ImplGlfw_NewFrame();
   ImGui::NewFrame();
   ImGui::SetNextWindowPos(ImVec2(25, 25), ImGuiCond_FirstUseEver);
   ImGui::Begin("Simulation Controls", nullptr,
                ImGuiWindowFlags_AlwaysAutoResize);
-  ImGui::SliderFloat("Smoothing Radius", &smoothingRadius, 0.003f, 0.02f);
-  ImGui::SliderFloat("Density", &targetDensity, 0.01f, 6.0f);
-  ImGui::SliderFloat("Pressure", &pressureStrength, 0.05f, 30.0f);
-  ImGui::SliderFloat("Near Pressure", &nearPressureStrength, 0.0f, 0.3f);
-  ImGui::SliderFloat("Viscosity", &viscosityStrength, 0.0f, 1.0f);
-  ImGui::SliderFloat("Gravity", &gravity, 0.0f, 20.0f);
+  ImGui::SliderFloat("Smoothing Radius", &settings.smoothingRadius, 0.003f,
+                     0.02f);
+  ImGui::SliderFloat("Density", &settings.targetDensity, 0.01f, 6.0f);
+  ImGui::SliderFloat("Pressure", &settings.pressureStrength, 0.05f, 30.0f);
+  ImGui::SliderFloat("Near Pressure", &settings.nearPressureStrength, 0.0f,
+                     0.3f);
+  ImGui::SliderFloat("Viscosity", &settings.viscosityStrength, 0.0f, 1.0f);
+  ImGui::SliderFloat("Gravity", &settings.gravity, 0.0f, 20.0f);
 
-  if (ImGui::Button(running ? "Pause" : "Resume"))
-    running = !running;
+  if (ImGui::Button(settings.running ? "Pause" : "Resume"))
+    settings.running = !settings.running;
   ImGui::SameLine();
   if (ImGui::Button("Reset"))
     resetRequested = true;
+  ImGui::Checkbox("Adaptive timestep", &settings.adaptiveTimestep);
+  if (settings.adaptiveTimestep) {
+    ImGui::SliderFloat("CFL number", &settings.cflNumber, 0.05f, 1.0f);
+    ImGui::Text("dt %.2f ms", readout.simDeltaTime * 1000.0f);
+  }
+  ImGui::Checkbox("Real-time stepping", &settings.realTimeStepping);
+  if (settings.realTimeStepping) {
+    ImGui::SliderFloat("Step budget (ms)", &settings.stepBudgetMs, 1.0f, 33.0f);
+    ImGui::SliderInt("Max substeps", &settings.maxSubstepsPerFrame, 1, 16);
+    ImGui::Text("Substeps %d, behind %.1f ms, dropped %.2f s",
+                readout.lastSubsteps, readout.simBacklogSeconds * 1000.0,
+                readout.simDroppedSeconds);
+    // The simulation thread publishes single states
+    if (!simulationThread)
+      ImGui::Checkbox("Interpolate rendering", &settings.renderInterpolation);
+  }
   if (ImGui::Button(phoneGyro ? "Deactivate PhoneGyro" : "Activate PhoneGyro"))
     phoneGyro = !phoneGyro;
 
-  static const int particleCounts[] = {16384,  32768,  65536,  131072,
-                                       262144, 524288, 1048576};
-  static const char *particleCountLabels[] = {
+  static const char *particleCountLabels[NUM_PARTICLE_COUNT_PRESETS] = {
       "16384", "32768", "65536", "131072", "262144", "524288", "1048576"};
   int countIndex = 0;
-  for (int i = 0; i < 7; i++)
-    if (particleCounts[i] == pendingNumParticles)
+  for (int i = 0; i < NUM_PARTICLE_COUNT_PRESETS; i++)
+    if (particleCountPresets[i] == pendingNumParticles)
       countIndex = i;
-  if (ImGui::Combo("Particles", &countIndex, particleCountLabels, 7))
-    pendingNumParticles = particleCounts[countIndex];
+  if (ImGui::Combo("Particles", &countIndex, particleCountLabels,
+                   NUM_PARTICLE_COUNT_PRESETS))
+    pendingNumParticles = particleCountPresets[countIndex];
 
   if (ImGui::Checkbox("VSync", &vsyncEnabled))
     glfwSwapInterval(vsyncEnabled ? 1 : 0);
 
   ImGui::Text("Application average %.3f ms/frame (%.1f FPS)",
               frameTime * 1000.0, 1 / frameTime);
+  if (simulationThread)
+    ImGui::Text("Simulation thread %.1f steps/s", simThreadStepRate.load());
 
   if (ImGui::CollapsingHeader("GPU timings", ImGuiTreeNodeFlags_DefaultOpen)) {
+    ImGui::Text("Backend: %s", simulation->name());
+    ImGui::Checkbox("Row neighbor ranges", &settings.neighborRowRanges);
+    ImGui::Checkbox("Tiled neighbor gather", &settings.tiledNeighborGather);
+    ImGui::Checkbox("Single-pass scan", &settings.singlePassScan);
+    ImGui::Checkbox("Shared count histogram", &settings.sharedCountHistogram);
+    ImGui::Checkbox("Deterministic scatter", &settings.deterministicScatter);
+    ImGui::Checkbox("Morton cell order", &settings.mortonCellOrder);
+    ImGui::Checkbox("Sparse brick grid", &settings.sparseBrickGrid);
+    ImGui::Checkbox("Fit grid to fluid", &settings.fittedGrid);
+    ImGui::Checkbox("Box-local grid", &settings.boxLocalGrid);
+    ImGui::Checkbox("Neighbor lists", &settings.neighborLists);
+    if (settings.neighborLists) {
+      ImGui::SliderFloat("List skin (h)", &settings.neighborSkin, 0.05f, 1.0f);
+      ImGui::Text("List rebuilds %5.1f%% of steps",
+                  readout.listRebuildRate * 100.0f);
+    }
+    ImGui::Checkbox("Fused external + count", &settings.fusedExternalCount);
     double total = 0.0;
     for (int i = 0; i < GPU_PASS_COUNT; i++) {
-      ImGui::Text("%-9s %6.3f ms", gpuPassNames[i], gpuPassMs[i]);
-      total += gpuPassMs[i];
+      ImGui::Text("%-9s %6.3f ms", gpuPassNames[i], readout.gpuPassMs[i]);
+      total += readout.gpuPassMs[i];
     }
     ImGui::Separator();
     ImGui::Text("%-9s %6.3f ms", "Total", total);
   }
+
+  if (ImGui::CollapsingHeader("Fluid statistics")) {
+    ImGui::Checkbox("Collect (GPU)", &settings.fluidStatistics);
+    if ((settings.fluidStatistics || settings.adaptiveTimestep) &&
+        readout.fluidStats.valid) {
+      const FluidStats &s = readout.fluidStats;
+      ImGui::Text("Max speed      %8.3f", s.maxSpeed);
+      ImGui::Text("Max accel      %8.1f", s.maxAcceleration);
+      ImGui::Text("Kinetic energy %8.3f", s.kineticEnergy);
+      ImGui::Text("Density error  %6.2f%% mean, %6.2f%% max",
+                  s.meanDensityError * 100.0f, s.maxDensityError * 100.0f);
+      ImGui::Text("Bounds min %6.3f %6.3f %6.3f", s.boundsMin.x, s.boundsMin.y,
+                  s.boundsMin.z);
+      ImGui::Text("Bounds max %6.3f %6.3f %6.3f", s.boundsMax.x, s.boundsMax.y,
+                  s.boundsMax.z);
+    }
+  }
   ImGui::End();
 
   ImGui::SetNextWindowPos(ImVec2(550, 25), ImGuiCond_FirstUseEver);
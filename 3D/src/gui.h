@@ -4,6 +4,7 @@
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
 #include <GLFW/glfw3.h>
+#include <memory>
 
 extern float sphereRadius;
 extern double frameTime;
@@ -16,7 +17,10 @@ extern float waterAbsorption;
 extern bool shadowsEnabled;
 extern float shadowStrength;
 extern bool phoneGyro;
+extern std::unique_ptr<SimulationBackend> simulation;
 
 void setupGUI(GLFWwindow *window);
-void renderGUI();
+// Widgets edit the main thread's copy of the settings (see
+// SimulationSettings) and show the readout of the latest steps
+void renderGUI(SimulationSettings &settings, const SimulationReadout &readout);
 void shutdownGUI();
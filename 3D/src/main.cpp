@@ -6,20 +6,25 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <cstring>
 #include <iostream>
+#include <memory>
 
 #include "camera.h"
+#include "cpu_simulation.h"
 #include "gui.h"
 #include "renderer.h"
 #include "shader.h"
+#include "sim_thread.h"
 #include "simulation.h"
 #include "src/gyro_source.h"
 #include "utilities.h"
 
 float angle;
-extern glm::mat4 boxTransform;
-extern glm::mat4 boxTransformInverse;
 bool singleAxis = true;
+// The main thread's copy of what the GUI and input edit: applied before each
+// step, or handed to the simulation thread
+SimulationSettings simSettings;
 
 // Globals - Definitions moved to their respective files
 GLFWwindow *window;
@@ -32,21 +37,14 @@ int scrHeight = SCR_HEIGHT;
 float lastX = SCR_WIDTH / 2.0f;
 float lastY = SCR_HEIGHT / 2.0f;
 bool firstMouse = true;
-const float fixedDeltaTime = 1.0f / 120.0f; // simulation timestep
 bool altPressed = false;
 bool spacePressed = false;
 bool cameraMode = false;
 double frameTime = 0.0;
-bool running = true;
 bool phoneGyro = false;
 bool resetRequested = false;
 bool vsyncEnabled = false;
 float sphereRadius = 3.5f;
-float targetDensity = 3.75f;
-float pressureStrength = 27.0f;
-float nearPressureStrength = 0.022f;
-float viscosityStrength = 0.03f;
-float gravity = 9.8f;
 float boundSpeed = 1.0f;
 
 // Orbit camera (left-drag when not in fly mode)
@@ -58,10 +56,17 @@ float orbitRadius = 1.0f;
 // Particle rendering
 GLuint renderProgram;
 ParticleBuffers particleBuffers;
+// Simulation backend, picked at startup (--cpu for the CPU backend;
+// --compact selects the compact particle storage on the GPU backend;
+// --sim-thread steps it on its own thread, see sim_thread.h)
+std::unique_ptr<SimulationBackend> simulation;
 // Cube rendering
 GLuint cubeProgram;
 GLuint cubeVAO, cubeVBO, cubeEBO;
 GLuint quadVAO, quadVBO;
+// Render interpolation: one VAO per newest render position buffer
+GLuint interpVAO[2], interpVBO[2];
+int interpGeneration = -1;
 // Checkered floor below the box
 GLuint floorProgram;
 GLuint floorVAO, floorVBO;
@@ -77,21 +82,40 @@ void framebuffer_size_callback(GLFWwindow *window, int width, int height);
 static glm::vec3 currentBoxCenter() {
   // The box rotates around its own center, so the local center is also the
   // world-space one
-  return glm::vec3((topX + botX) / 2.0f, (topY + botY) / 2.0f,
-                   (topZ + botZ) / 2.0f);
+  const SimulationSettings &s = simSettings;
+  return glm::vec3((s.topX + s.botX) / 2.0f, (s.topY + s.botY) / 2.0f,
+                   (s.topZ + s.botZ) / 2.0f);
 }
 
-static void rebuildParticleBuffers() {
-  deleteParticleBuffers(&particleBuffers);
-  glDeleteBuffers(1, &quadVBO);
-  glDeleteVertexArrays(1, &quadVAO);
-  createParticleBuffers(&particleBuffers);
-  setupQuadBuffers(&quadVAO, &quadVBO, particleBuffers.positions,
-                   particleBuffers.velocities);
-  updateNumParticlesUniform();
+static void resizeParticles(bool respawn) {
+  GLuint positions = particleBuffers.positions;
+  resizeParticleBuffers(&particleBuffers, respawn);
+  // The quad VAO only needs rebuilding when the buffers were reallocated
+  if (particleBuffers.positions != positions) {
+    glDeleteBuffers(1, &quadVBO);
+    glDeleteVertexArrays(1, &quadVAO);
+    setupQuadBuffers(&quadVAO, &quadVBO, particleBuffers.positions,
+                     particleBuffers.velocities);
+  }
+  simulation->resetParticles();
 }
 
-int main() {
+int main(int argc, char **argv) {
+  bool useCpuBackend = false;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--cpu") == 0)
+      useCpuBackend = true;
+    else if (std::strcmp(argv[i], "--compact") == 0)
+      compactParticles = true;
+    else if (std::strcmp(argv[i], "--sim-thread") == 0)
+      simulationThread = true;
+    else if (std::strcmp(argv[i], "--no-shader-cache") == 0)
+      programBinaryCache = false;
+  }
+  // The CPU backend reads and writes the particle buffers as vec4s
+  compactParticles = compactParticles && !useCpuBackend;
+  simSettings = currentSimulationSettings();
+
   // Prefer X11, but fall back to whatever platform GLFW picks (e.g. on a
   // Wayland-only session)
   glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_X11);
@@ -135,16 +159,45 @@ int main() {
 
   glEnable(GL_PROGRAM_POINT_SIZE);
 
-  // Shader Compilation
-  renderProgram = createRenderProgram(vertexShaderSource, fragmentShaderSource);
-  cubeProgram = createLineProgram(cubeVertexSource, cubeFragmentSource);
-  floorProgram = createRenderProgram(floorVertexSource, floorFragmentSource);
-  setupComputeShaders();
+  // Shader Compilation. Everything is submitted before anything is waited
+  // on: with parallel shader compilation the driver builds these programs
+  // while the simulation's compute programs compile, and the water programs
+  // finish in the background while the first frames run
+  renderProgram = submitRenderProgram(vertexShaderSource, fragmentShaderSource);
+  cubeProgram = submitLineProgram(cubeVertexSource, cubeFragmentSource);
+  floorProgram = submitRenderProgram(floorVertexSource, floorFragmentSource);
+  setupWaterRenderer(scrWidth, scrHeight);
+
+  // Buffer Creation. The simulation thread creates the backend and the
+  // particle buffers in its own context.
+  if (simulationThread && !startSimulationThread(window, useCpuBackend)) {
+    std::cerr << "Failed to create the simulation context; stepping on the "
+                 "main thread"
+              << std::endl;
+    simulationThread = false;
+  }
+  if (!simulationThread) {
+    if (useCpuBackend)
+      simulation = std::make_unique<CpuSimulation>(&particleBuffers);
+    else
+      simulation = std::make_unique<GpuSimulation>();
+    createParticleBuffers(&particleBuffers);
+    simulation->resetParticles();
+    setupQuadBuffers(&quadVAO, &quadVBO, particleBuffers.positions,
+                     particleBuffers.velocities);
+  }
+
+  finishProgram(renderProgram);
+  finishProgram(cubeProgram);
+  finishProgram(floorProgram);
 
   // Uniform locations, fetched once
   GLint locProj = glGetUniformLocation(renderProgram, "u_proj");
   GLint locView = glGetUniformLocation(renderProgram, "u_view");
   GLint locSphereRadius = glGetUniformLocation(renderProgram, "sphereRadius");
+  GLint locQuantMin = glGetUniformLocation(renderProgram, "quantMin");
+  GLint locQuantExtent = glGetUniformLocation(renderProgram, "quantExtent");
+  GLint locAlpha = glGetUniformLocation(renderProgram, "u_alpha");
   GLint locCubeModel = glGetUniformLocation(cubeProgram, "u_model");
   GLint locCubeProj = glGetUniformLocation(cubeProgram, "u_proj");
   GLint locCubeView = glGetUniformLocation(cubeProgram, "u_view");
@@ -162,20 +215,18 @@ int main() {
   glUniform1f(glGetUniformLocation(floorProgram, "u_tileColVariation"), 0.2f);
   glUniform1i(glGetUniformLocation(floorProgram, "u_shadowMap"), 1);
 
-  // Buffer Creation
-  createParticleBuffers(&particleBuffers);
-
   setupCubeBuffers(&cubeVAO, &cubeVBO, &cubeEBO);
   setupFloorBuffers(&floorVAO, &floorVBO);
-  setupQuadBuffers(&quadVAO, &quadVBO, particleBuffers.positions,
-                   particleBuffers.velocities);
 
-  setupWaterRenderer(scrWidth, scrHeight);
   setupGUI(window);
 
   GyroSource gyro("10.233.149.135", "8080");
   gyro.start();
 
+  // Box the cube VBO was last built for: the drawn state's, which with the
+  // simulation thread trails the edited one
+  glm::vec3 cubeBoxMin(0.0f), cubeBoxMax(0.0f);
+
   double currentTime = glfwGetTime();
   while (!glfwWindowShouldClose(window)) {
     double newTime = glfwGetTime();
@@ -194,18 +245,66 @@ int main() {
 
     processInput(window);
 
-    // Apply GUI-driven reset / particle count changes between frames
-    if (resetRequested || pendingNumParticles != numParticles) {
-      numParticles = pendingNumParticles;
-      rebuildParticleBuffers();
-      resetRequested = false;
+    // GUI-driven reset / particle count changes apply before the next step.
+    // A count change alone keeps the fluid and adds or removes particles.
+    bool resize =
+        resetRequested || pendingNumParticles != simSettings.numParticles;
+    simSettings.numParticles = pendingNumParticles;
+
+    // The step size stays fixed for stability. By default one step per
+    // rendered frame, so sim speed follows the framerate; real-time stepping
+    // runs as many substeps as the elapsed wall time and the step budget
+    // allow instead. The simulation thread steps on its own, and takes the
+    // settings between its steps.
+    SimulationReadout readout;
+    if (simulationThread) {
+      submitSimulationSettings(simSettings, resetRequested);
+    } else {
+      applySimulationSettings(simSettings);
+      if (resize)
+        resizeParticles(resetRequested);
+      if (realTimeStepping)
+        stepRealTime(*simulation, frameTime);
+      else
+        simulation->step();
+      readout = currentSimulationReadout();
+    }
+    resetRequested = false;
+
+    // Without the simulation thread the particles are drawn straight from
+    // the simulation buffers, or blended between the last two steps with
+    // render interpolation; with it, from the newest published state
+    ParticleDrawState particles;
+    RenderStateBuffers renderState;
+    if (simulationThread) {
+      particles = acquirePublishedState(&readout);
+    } else if (realTimeStepping && renderStateBuffers(&renderState)) {
+      if (renderState.generation != interpGeneration) {
+        for (int i = 0; i < 2; i++) {
+          glDeleteVertexArrays(1, &interpVAO[i]);
+          glDeleteBuffers(1, &interpVBO[i]);
+          setupInterpolatedQuadBuffers(&interpVAO[i], &interpVBO[i],
+                                       renderState.positions[i ^ 1],
+                                       renderState.positions[i],
+                                       renderState.velocities);
+        }
+        interpGeneration = renderState.generation;
+      }
+      // Unpacked positions: the compact decode becomes the identity
+      particles = {interpVAO[renderState.newest], numParticles,
+                   glm::vec3(0.0f), glm::vec3(1.0f),
+                   renderInterpolationAlpha(), glm::vec3(botX, botY, botZ),
+                   glm::vec3(topX, topY, topZ), boxTransform};
+    } else {
+      particles = {quadVAO, numParticles, quantMin, quantExtent, 1.0f,
+                   glm::vec3(botX, botY, botZ), glm::vec3(topX, topY, topZ),
+                   boxTransform};
+    }
+    if (particles.boxMin != cubeBoxMin || particles.boxMax != cubeBoxMax) {
+      updateCubeBounds(cubeVBO, particles.boxMin, particles.boxMax);
+      cubeBoxMin = particles.boxMin;
+      cubeBoxMax = particles.boxMax;
     }
-
-    // One fixed-size step per rendered frame: the GPU is the bottleneck, so
-    // stepping multiple times per frame to track real time only lowers the
-    // framerate. The step size stays fixed for stability, which means sim
-    // speed follows the framerate.
-    runSimulationFrame();
 
     glm::mat4 Projection =
         glm::perspective(glm::radians(camera.Zoom),
@@ -216,7 +315,8 @@ int main() {
       glEnable(GL_BLEND);
       glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
       glUseProgram(cubeProgram);
-      glUniformMatrix4fv(locCubeModel, 1, GL_FALSE, &boxTransform[0][0]);
+      glUniformMatrix4fv(locCubeModel, 1, GL_FALSE,
+                         &particles.boxTransform[0][0]);
       glUniformMatrix4fv(locCubeProj, 1, GL_FALSE, &Projection[0][0]);
       glUniformMatrix4fv(locCubeView, 1, GL_FALSE, &View[0][0]);
       glBindVertexArray(cubeVAO);
@@ -225,11 +325,13 @@ int main() {
     };
 
     auto drawFloor = [&]() {
-      glm::vec2 center(0.5f * (botX + topX), 0.5f * (botZ + topZ));
+      glm::vec3 boxMin = particles.boxMin, boxMax = particles.boxMax;
+      glm::vec2 center(0.5f * (boxMin.x + boxMax.x),
+                       0.5f * (boxMin.z + boxMax.z));
       // Slightly below botY to avoid z-fighting with the cube's bottom edges
       glm::mat4 model =
           glm::translate(glm::mat4(1.0f),
-                         glm::vec3(center.x, botY - 0.001f, center.y)) *
+                         glm::vec3(center.x, boxMin.y - 0.001f, center.y)) *
           glm::scale(glm::mat4(1.0f), glm::vec3(3.0f, 1.0f, 3.0f));
       glUseProgram(floorProgram);
       glUniformMatrix4fv(locFloorModel, 1, GL_FALSE, &model[0][0]);
@@ -252,14 +354,14 @@ int main() {
     resizeWaterRenderer(scrWidth, scrHeight);
     // Fluid shadow map, sampled by the floor (and the water composite) in
     // both render modes
-    renderShadowMap(quadVAO, sphereRadius / 1000);
-    if (waterRendering) {
+    renderShadowMap(particles, sphereRadius / 1000);
+    if (waterRendering && waterRendererReady()) {
       // Background + cube go to the offscreen scene target; the water passes
       // then composite everything to the default framebuffer
       beginScenePass();
       drawFloor();
       drawCube();
-      renderWater(quadVAO, Projection, View, sphereRadius / 1000);
+      renderWater(particles, Projection, View, sphereRadius / 1000);
     } else {
       // Plain sphere-impostor view
       glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -275,14 +377,20 @@ int main() {
       glUniformMatrix4fv(locProj, 1, GL_FALSE, &Projection[0][0]);
       glUniformMatrix4fv(locView, 1, GL_FALSE, &View[0][0]);
       glUniform1f(locSphereRadius, sphereRadius / 1000);
-      glBindVertexArray(quadVAO);
-      glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, numParticles);
+      glUniform3fv(locQuantMin, 1, &particles.quantMin[0]);
+      glUniform3fv(locQuantExtent, 1, &particles.quantExtent[0]);
+      glUniform1f(locAlpha, particles.alpha);
+      glBindVertexArray(particles.vao);
+      glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, particles.count);
 
       drawCube();
     }
 
-    // Render GUI
-    renderGUI();
+    if (simulationThread)
+      releasePublishedState();
+
+    // Render GUI (its widgets edit simSettings, taken up next frame)
+    renderGUI(simSettings, readout);
 
     glfwSwapBuffers(window);
     glfwPollEvents();
@@ -291,10 +399,16 @@ int main() {
   // Cleanup
   shutdownGUI();
   shutdownWaterRenderer();
-  shutdownSimulation();
-  deleteParticleBuffers(&particleBuffers);
+  if (simulationThread) {
+    stopSimulationThread();
+  } else {
+    simulation.reset();
+    deleteParticleBuffers(&particleBuffers);
+  }
   glDeleteVertexArrays(1, &quadVAO);
   glDeleteBuffers(1, &quadVBO);
+  glDeleteVertexArrays(2, interpVAO);
+  glDeleteBuffers(2, interpVBO);
   glDeleteVertexArrays(1, &cubeVAO);
   glDeleteBuffers(1, &cubeVBO);
   glDeleteBuffers(1, &cubeEBO);
@@ -314,7 +428,7 @@ void processInput(GLFWwindow *window) {
     glfwSetWindowShouldClose(window, true);
 
   if (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS && !spacePressed) {
-    running = !running;
+    simSettings.running = !simSettings.running;
     spacePressed = true;
   } else if (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_RELEASE) {
     spacePressed = false;
@@ -334,41 +448,38 @@ void processInput(GLFWwindow *window) {
   // but independent of the actual framerate
   float realBoundSpeed = boundSpeed * 0.12f * (float)frameTime;
 
+  SimulationSettings &s = simSettings;
   if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS) {
-    topX += realBoundSpeed;
+    s.topX += realBoundSpeed;
     if (!singleAxis)
-      botX -= realBoundSpeed;
-    updateCubeBounds(cubeVBO);
+      s.botX -= realBoundSpeed;
   }
   if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS) {
-    topX -= realBoundSpeed;
+    s.topX -= realBoundSpeed;
     if (!singleAxis)
-      botX += realBoundSpeed;
-    updateCubeBounds(cubeVBO);
+      s.botX += realBoundSpeed;
   }
   if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS) {
-    botZ -= realBoundSpeed;
+    s.botZ -= realBoundSpeed;
     if (!singleAxis)
-      topZ += realBoundSpeed;
-    updateCubeBounds(cubeVBO);
+      s.topZ += realBoundSpeed;
   }
   if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS) {
-    botZ += realBoundSpeed;
+    s.botZ += realBoundSpeed;
     if (!singleAxis)
-      topZ -= realBoundSpeed;
-    updateCubeBounds(cubeVBO);
+      s.topZ -= realBoundSpeed;
   }
 
   if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS) {
     angle += 1.2f * (float)frameTime;
     glm::vec3 boxCenter = currentBoxCenter();
     // Build the transformation matrix to rotate around the center of the box
-    boxTransform =
+    s.boxTransform =
         glm::translate(glm::mat4(1.0f), boxCenter) *
         glm::rotate(glm::mat4(1.0f), angle, glm::vec3(0.0f, 1.0f, 0.0f)) *
         glm::translate(glm::mat4(1.0f), -boxCenter);
     // Recalculate the inverse transform for the compute shader
-    boxTransformInverse = glm::inverse(boxTransform);
+    s.boxTransformInverse = glm::inverse(s.boxTransform);
   }
 
   if (glfwGetKey(window, GLFW_KEY_LEFT_ALT) == GLFW_PRESS && !altPressed) {
@@ -9,8 +9,6 @@ float waterAbsorption = 9.0f;
 bool shadowsEnabled = true;
 float shadowStrength = 0.6f;
 
-extern glm::mat4 boxTransform;
-
 namespace {
 
 // Bilateral range weight: rejects depth differences larger than a few
@@ -25,6 +23,7 @@ const int SHADOW_RES = 1024;
 int fbWidth = 0, fbHeight = 0;
 
 GLuint depthProgram, thicknessProgram, blurProgram, compositeProgram;
+bool waterProgramsLinked = false;
 
 GLuint shadowFBO, shadowTex, shadowDepthRB;
 glm::mat4 lightView(1.0f), lightVP(1.0f);
@@ -38,7 +37,7 @@ GLuint fluidSmoothFBO, fluidSmoothTex;
 GLuint thicknessFBO, thicknessTex;
 
 struct {
-  GLint proj, view, sphereRadius;
+  GLint proj, view, sphereRadius, quantMin, quantExtent, alpha;
 } depthU, thicknessU;
 struct {
   GLint blurDir, depthFalloff;
@@ -124,36 +123,43 @@ void deleteTargets() {
   glDeleteRenderbuffers(1, &fluidDepthRB);
 }
 
-void drawParticles(GLuint particleVAO, GLuint program, const glm::mat4 &proj,
-                   const glm::mat4 &view, float radius,
+void drawParticles(const ParticleDrawState &particles, GLuint program,
+                   const glm::mat4 &proj, const glm::mat4 &view, float radius,
                    const decltype(depthU) &uniforms) {
   glUseProgram(program);
   glUniformMatrix4fv(uniforms.proj, 1, GL_FALSE, &proj[0][0]);
   glUniformMatrix4fv(uniforms.view, 1, GL_FALSE, &view[0][0]);
   glUniform1f(uniforms.sphereRadius, radius);
-  glBindVertexArray(particleVAO);
-  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, numParticles);
+  glUniform3fv(uniforms.quantMin, 1, &particles.quantMin[0]);
+  glUniform3fv(uniforms.quantExtent, 1, &particles.quantExtent[0]);
+  glUniform1f(uniforms.alpha, particles.alpha);
+  glBindVertexArray(particles.vao);
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, particles.count);
 }
 
-} // namespace
-
-void setupWaterRenderer(int width, int height) {
-  depthProgram =
-      createRenderProgram(vertexShaderSource, fluidDepthFragmentSource);
-  thicknessProgram =
-      createRenderProgram(vertexShaderSource, thicknessFragmentSource);
-  blurProgram = createRenderProgram(fullscreenVertexSource, blurFragmentSource);
-  compositeProgram =
-      createRenderProgram(fullscreenVertexSource, compositeFragmentSource);
+// Finishes the programs setupWaterRenderer submitted and fetches their
+// uniform locations
+void linkWaterPrograms() {
+  GLuint programs[] = {depthProgram, thicknessProgram, blurProgram,
+                       compositeProgram};
+  for (GLuint program : programs)
+    finishProgram(program);
 
   depthU.proj = glGetUniformLocation(depthProgram, "u_proj");
   depthU.view = glGetUniformLocation(depthProgram, "u_view");
   depthU.sphereRadius = glGetUniformLocation(depthProgram, "sphereRadius");
+  depthU.quantMin = glGetUniformLocation(depthProgram, "quantMin");
+  depthU.quantExtent = glGetUniformLocation(depthProgram, "quantExtent");
+  depthU.alpha = glGetUniformLocation(depthProgram, "u_alpha");
 
   thicknessU.proj = glGetUniformLocation(thicknessProgram, "u_proj");
   thicknessU.view = glGetUniformLocation(thicknessProgram, "u_view");
   thicknessU.sphereRadius =
       glGetUniformLocation(thicknessProgram, "sphereRadius");
+  thicknessU.quantMin = glGetUniformLocation(thicknessProgram, "quantMin");
+  thicknessU.quantExtent =
+      glGetUniformLocation(thicknessProgram, "quantExtent");
+  thicknessU.alpha = glGetUniformLocation(thicknessProgram, "u_alpha");
 
   blurU.blurDir = glGetUniformLocation(blurProgram, "blurDir");
   blurU.depthFalloff = glGetUniformLocation(blurProgram, "depthFalloff");
@@ -177,6 +183,20 @@ void setupWaterRenderer(int width, int height) {
   glUniform1i(glGetUniformLocation(compositeProgram, "sceneColorTex"), 2);
   glUniform1i(glGetUniformLocation(compositeProgram, "sceneDepthTex"), 3);
   glUniform1i(glGetUniformLocation(compositeProgram, "shadowMapTex"), 4);
+}
+
+} // namespace
+
+void setupWaterRenderer(int width, int height) {
+  // Finished on first use (waterRendererReady), so they can compile while
+  // the simulation starts up
+  depthProgram =
+      submitRenderProgram(vertexShaderSource, fluidDepthFragmentSource);
+  thicknessProgram =
+      submitRenderProgram(vertexShaderSource, thicknessFragmentSource);
+  blurProgram = submitRenderProgram(fullscreenVertexSource, blurFragmentSource);
+  compositeProgram =
+      submitRenderProgram(fullscreenVertexSource, compositeFragmentSource);
 
   // Light-space fluid depth, fixed resolution (independent of window resizes).
   // NEAREST: the shaders compare depths per tap, interpolating across the
@@ -198,23 +218,24 @@ void setupWaterRenderer(int width, int height) {
   createTargets(width, height);
 }
 
-void renderShadowMap(GLuint particleVAO, float sphereRadiusWorld) {
+void renderShadowMap(const ParticleDrawState &particles,
+                     float sphereRadiusWorld) {
   glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
   glViewport(0, 0, SHADOW_RES, SHADOW_RES);
   float zero[4] = {0, 0, 0, 0};
   glClearBufferfv(GL_COLOR, 0, zero);
   glClear(GL_DEPTH_BUFFER_BIT);
-  if (!shadowsEnabled || shadowStrength <= 0.0f)
-    return; // empty map reads as "no fluid", i.e. fully lit
+  // An empty map reads as "no fluid", i.e. fully lit
+  if (!shadowsEnabled || shadowStrength <= 0.0f || !waterRendererReady())
+    return;
 
   // Fit the ortho frustum around the (possibly rotated/resized) box; the
   // particles are clamped inside it
-  glm::vec3 center = glm::vec3(
-      boxTransform * glm::vec4(0.5f * (botX + topX), 0.5f * (botY + topY),
-                               0.5f * (botZ + topZ), 1.0f));
-  float radius =
-      0.5f * glm::length(glm::vec3(topX - botX, topY - botY, topZ - botZ)) +
-      4.0f * sphereRadiusWorld;
+  glm::vec3 boxCenter = 0.5f * (particles.boxMin + particles.boxMax);
+  glm::vec3 center =
+      glm::vec3(particles.boxTransform * glm::vec4(boxCenter, 1.0f));
+  float radius = 0.5f * glm::length(particles.boxMax - particles.boxMin) +
+                 4.0f * sphereRadiusWorld;
   lightView =
       glm::lookAt(center + LIGHT_DIR * 2.0f * radius, center, glm::vec3(0, 1, 0));
   glm::mat4 lightProj =
@@ -222,10 +243,23 @@ void renderShadowMap(GLuint particleVAO, float sphereRadiusWorld) {
   lightVP = lightProj * lightView;
 
   glEnable(GL_DEPTH_TEST);
-  drawParticles(particleVAO, depthProgram, lightProj, lightView,
+  drawParticles(particles, depthProgram, lightProj, lightView,
                 sphereRadiusWorld, depthU);
 }
 
+bool waterRendererReady() {
+  if (waterProgramsLinked)
+    return true;
+  GLuint programs[] = {depthProgram, thicknessProgram, blurProgram,
+                       compositeProgram};
+  for (GLuint program : programs)
+    if (!programReady(program))
+      return false;
+  linkWaterPrograms();
+  waterProgramsLinked = true;
+  return true;
+}
+
 GLuint shadowMapTexture() { return shadowTex; }
 const glm::mat4 &lightViewMatrix() { return lightView; }
 const glm::mat4 &lightViewProjMatrix() { return lightVP; }
@@ -246,7 +280,7 @@ void beginScenePass() {
   glEnable(GL_DEPTH_TEST);
 }
 
-void renderWater(GLuint particleVAO, const glm::mat4 &proj,
+void renderWater(const ParticleDrawState &particles, const glm::mat4 &proj,
                  const glm::mat4 &view, float sphereRadiusWorld) {
   // Fluid depth
   glBindFramebuffer(GL_FRAMEBUFFER, fluidFBO);
@@ -255,7 +289,7 @@ void renderWater(GLuint particleVAO, const glm::mat4 &proj,
   glClearBufferfv(GL_COLOR, 0, zero);
   glClear(GL_DEPTH_BUFFER_BIT);
   glEnable(GL_DEPTH_TEST);
-  drawParticles(particleVAO, depthProgram, proj, view, sphereRadiusWorld,
+  drawParticles(particles, depthProgram, proj, view, sphereRadiusWorld,
                 depthU);
 
   // Bilateral blur, horizontal then vertical
@@ -280,7 +314,7 @@ void renderWater(GLuint particleVAO, const glm::mat4 &proj,
   glClearBufferfv(GL_COLOR, 0, zero);
   glEnable(GL_BLEND);
   glBlendFunc(GL_ONE, GL_ONE);
-  drawParticles(particleVAO, thicknessProgram, proj, view, sphereRadiusWorld,
+  drawParticles(particles, thicknessProgram, proj, view, sphereRadiusWorld,
                 thicknessU);
   glDisable(GL_BLEND);
 
@@ -325,4 +359,5 @@ void shutdownWaterRenderer() {
   glDeleteProgram(thicknessProgram);
   glDeleteProgram(blurProgram);
   glDeleteProgram(compositeProgram);
+  waterProgramsLinked = false;
 }
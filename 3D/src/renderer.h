@@ -15,13 +15,34 @@ extern float waterAbsorption;
 extern bool shadowsEnabled;
 extern float shadowStrength;
 
+// The particle state the impostor passes draw: the instanced quad VAO over a
+// positions/velocities pair, with that state's particle count and compact
+// storage bounds (quantMin/quantExtent of the step that produced it). With
+// render interpolation the VAO also carries the previous positions, blended
+// toward the current ones by alpha (1 otherwise). The box is the one that
+// state was stepped in, so the cube, floor and shadow map frame it.
+struct ParticleDrawState {
+  GLuint vao;
+  int count;
+  glm::vec3 quantMin, quantExtent;
+  float alpha;
+  glm::vec3 boxMin, boxMax;
+  glm::mat4 boxTransform;
+};
+
+// Submits the water programs without waiting for them (see shader.h)
 void setupWaterRenderer(int width, int height);
+// Finishes the water programs once the driver has built them, then true.
+// Until then the water passes and the shadow map must not run.
+bool waterRendererReady();
 void resizeWaterRenderer(int width, int height);
 // Renders the particle impostors from the light's view into the shadow map
 // (light-space depth of the frontmost fluid). Call once per frame before the
 // scene is drawn; used by the floor shader (cast shadow) in both render modes
-// and by the composite pass (self-shadowing). Leaves the shadow FBO bound.
-void renderShadowMap(GLuint particleVAO, float sphereRadiusWorld);
+// and by the composite pass (self-shadowing). Leaves the shadow FBO bound,
+// and the map empty while the water programs are still compiling.
+void renderShadowMap(const ParticleDrawState &particles,
+                     float sphereRadiusWorld);
 // Shadow map sampling state for the floor shader
 GLuint shadowMapTexture();
 const glm::mat4 &lightViewMatrix();
@@ -30,6 +51,6 @@ const glm::mat4 &lightViewProjMatrix();
 // the background scene (cube) into it with depth testing
 void beginScenePass();
 // Runs passes 2-5; leaves the default framebuffer bound
-void renderWater(GLuint particleVAO, const glm::mat4 &proj,
+void renderWater(const ParticleDrawState &particles, const glm::mat4 &proj,
                  const glm::mat4 &view, float sphereRadiusWorld);
 void shutdownWaterRenderer();
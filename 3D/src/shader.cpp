@@ -1,14 +1,21 @@
 #include "shader.h"
+#include "embedded_shaders.h"
 #include "simulation.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <sstream>
+#include <vector>
+
+bool programBinaryCache = true;
 
 namespace {
 
-// Shader paths are resolved relative to the executable so the program works
-// regardless of the current working directory.
 std::filesystem::path ExecutableDir() {
   std::error_code ec;
   std::filesystem::path exe =
@@ -18,6 +25,15 @@ std::filesystem::path ExecutableDir() {
   return exe.parent_path();
 }
 
+// On-disk shader paths are resolved relative to SPH_SHADER_DIR when it is
+// set, else relative to the executable so the program works regardless of
+// the current working directory.
+std::filesystem::path ShaderRoot() {
+  if (const char *dir = std::getenv("SPH_SHADER_DIR"))
+    return dir;
+  return ExecutableDir();
+}
+
 std::string LoadFile(const std::filesystem::path &path) {
   std::ifstream file(path);
   if (!file.is_open()) {
@@ -29,12 +45,8 @@ std::string LoadFile(const std::filesystem::path &path) {
 }
 
 // Expands #include "file" directives (one level, relative to the shader's
-// directory) and injects the C++-side constants right after the #version
-// line so shaders and host code can never disagree on them.
-std::string PreprocessShader(const std::filesystem::path &shader_path) {
-  const std::string preamble =
-      "#define WORKGROUP_SIZE " + std::to_string(WORKGROUP_SIZE) + "\n";
-
+// directory), as tools/embed_shaders.cpp does for the embedded copies
+std::string ExpandIncludes(const std::filesystem::path &shader_path) {
   std::istringstream input(LoadFile(shader_path));
   std::ostringstream output;
   std::string line;
@@ -46,69 +58,312 @@ std::string PreprocessShader(const std::filesystem::path &shader_path) {
       output << LoadFile(shader_path.parent_path() / include_name) << '\n';
     } else {
       output << line << '\n';
-      if (line.rfind("#version", 0) == 0)
-        output << preamble;
     }
   }
   return output.str();
 }
 
-} // namespace
+// Injects the C++-side constants (and the particle storage layout) right
+// after the #version line so shaders and host code can never disagree on
+// them, followed by the variant's own defines
+std::string PreprocessShader(const std::string &source,
+                             const ShaderDefines &defines) {
+  std::string preamble =
+      "#define WORKGROUP_SIZE " + std::to_string(WORKGROUP_SIZE) + "\n";
+  if (compactParticles)
+    preamble += "#define COMPACT_PARTICLES\n";
+  for (const auto &define : defines)
+    preamble += "#define " + define.first + " " + define.second + "\n";
 
-GLuint CompileShader(const std::string &relative_path, GLenum shader_type,
-                     const std::string &shader_name) {
-  std::string shader_code;
+  size_t version = source.rfind("#version", 0) == 0
+                       ? 0
+                       : source.find("\n#version");
+  if (version == std::string::npos)
+    return preamble + source;
+  size_t line_end = source.find('\n', version + 1);
+  if (line_end == std::string::npos)
+    return source + "\n" + preamble;
+  return source.substr(0, line_end + 1) + preamble +
+         source.substr(line_end + 1);
+}
+
+// Preprocessed source of a shader, or "" (reported) when it can't be read.
+// The copy embedded at build time wins unless SPH_SHADER_DIR points at a
+// shader tree (for editing shaders without rebuilding); shaders that were
+// not embedded are read from disk.
+std::string ReadShader(const std::string &relative_path,
+                       const ShaderDefines &defines) {
   try {
-    shader_code = PreprocessShader(ExecutableDir() / relative_path);
-    if (shader_code.empty()) {
+    const char *embedded = std::getenv("SPH_SHADER_DIR")
+                               ? nullptr
+                               : embeddedShaderSource(relative_path);
+    std::string source = embedded
+                             ? std::string(embedded)
+                             : ExpandIncludes(ShaderRoot() / relative_path);
+    if (source.empty()) {
       std::cerr << "ERROR::SHADER::FILE_IS_EMPTY: " << relative_path
                 << std::endl;
-      return 0;
+      return "";
     }
+    return PreprocessShader(source, defines);
   } catch (const std::exception &e) {
     std::cerr << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << e.what()
               << std::endl;
-    return 0;
+    return "";
   }
+}
+
+// Starts the compile; errors are checked by the caller, once it needs the
+// result
+GLuint CompileSource(const std::string &shader_code, GLenum shader_type) {
+  if (shader_code.empty())
+    return 0;
   const char *shader_code_cstr = shader_code.c_str();
   GLuint shader = glCreateShader(shader_type);
   glShaderSource(shader, 1, &shader_code_cstr, nullptr);
   glCompileShader(shader);
-  checkCompileErrors(shader, shader_name);
   return shader;
 }
 
-GLuint createRenderProgram(const std::string &vertexPath,
-                           const std::string &fragmentPath) {
-  GLuint vertexShader = CompileShader(vertexPath, GL_VERTEX_SHADER, "VERTEX");
-  GLuint fragmentShader =
-      CompileShader(fragmentPath, GL_FRAGMENT_SHADER, "FRAGMENT");
+bool ParallelCompileSupported() {
+  return GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+}
+
+// Lets the driver compile on as many threads as it likes. The limit is
+// context state, and each thread here owns one context.
+void EnableParallelCompile() {
+  thread_local bool enabled = false;
+  if (enabled || !ParallelCompileSupported())
+    return;
+  if (GLEW_KHR_parallel_shader_compile)
+    glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+  else
+    glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+  enabled = true;
+}
+
+// Programs submitted but not finished: their shaders, still to be checked
+// and deleted, and the cache entry to fill. Both the main and the
+// simulation thread submit programs.
+struct PendingProgram {
+  std::string name;
+  std::vector<std::pair<GLuint, std::string>> shaders; // shader, its label
+  std::filesystem::path cache_path; // empty when not cached
+};
+std::mutex pendingMutex;
+std::map<GLuint, PendingProgram> pendingPrograms;
+
+// Program binary cache. A linked program's binary is stored under a hash of
+// everything that decides it: the driver (GL renderer, vendor and version
+// strings) and every stage's type and preprocessed source, which includes
+// the injected defines. Any change to those gives a new key; a binary the
+// driver rejects anyway (glProgramBinary fails to link) is recompiled from
+// source and overwritten. Entries are never pruned; deleting the directory
+// is always safe.
+const uint32_t CACHE_MAGIC = 0x42485053; // "SPHB"
+const uint32_t CACHE_VERSION = 1;
+
+struct ShaderStage {
+  GLenum type;
+  std::string path;
+  std::string name; // labels compile errors
+  ShaderDefines defines;
+};
+
+uint64_t Fnv1a(const std::string &data, uint64_t hash) {
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+std::string GLString(GLenum name) {
+  const GLubyte *value = glGetString(name);
+  return value ? (const char *)value : "";
+}
+
+bool ProgramBinariesSupported() {
+  if (!programBinaryCache || !GLEW_ARB_get_program_binary)
+    return false;
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  return formats > 0;
+}
+
+std::filesystem::path CachePath(const std::vector<ShaderStage> &stages,
+                                const std::vector<std::string> &sources) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  hash = Fnv1a(std::to_string(CACHE_VERSION) + "\n" + GLString(GL_RENDERER) +
+                   "\n" + GLString(GL_VENDOR) + "\n" +
+                   GLString(GL_VERSION) + "\n",
+               hash);
+  for (size_t i = 0; i < stages.size(); i++)
+    hash = Fnv1a(std::to_string(stages[i].type) + "\n" + sources[i], hash);
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+  return ExecutableDir() / "shader_cache" / name;
+}
+
+// 0 when there is no usable entry
+GLuint LoadCachedProgram(const std::filesystem::path &path) {
+  std::ifstream file(path, std::ios::binary);
+  uint32_t header[3]; // magic, version, binary format
+  if (!file.read((char *)header, sizeof(header)) ||
+      header[0] != CACHE_MAGIC || header[1] != CACHE_VERSION)
+    return 0;
+  std::vector<char> binary((std::istreambuf_iterator<char>(file)),
+                           std::istreambuf_iterator<char>());
+  if (binary.empty())
+    return 0;
+
+  GLuint program = glCreateProgram();
+  glProgramBinary(program, header[2], binary.data(), (GLsizei)binary.size());
+  GLint success = GL_FALSE;
+  glGetProgramiv(program, GL_LINK_STATUS, &success);
+  if (!success) {
+    glDeleteProgram(program);
+    return 0;
+  }
+  return program;
+}
+
+// Best effort: a read-only or missing directory just means no caching
+void StoreCachedProgram(const std::filesystem::path &path, GLuint program) {
+  GLint success = GL_FALSE, length = 0;
+  glGetProgramiv(program, GL_LINK_STATUS, &success);
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (!success || length <= 0)
+    return;
+  std::vector<char> binary(length);
+  GLenum format = 0;
+  glGetProgramBinary(program, length, &length, &format, binary.data());
+
+  std::error_code ec;
+  std::filesystem::create_directories(path.parent_path(), ec);
+  // Written aside and renamed into place, so a concurrent launch never
+  // loads half a file
+  std::filesystem::path temp = path;
+  temp += ".tmp";
+  std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+  uint32_t header[3] = {CACHE_MAGIC, CACHE_VERSION, format};
+  file.write((const char *)header, sizeof(header));
+  file.write(binary.data(), length);
+  file.close();
+  if (file)
+    std::filesystem::rename(temp, path, ec);
+  else
+    std::filesystem::remove(temp, ec);
+}
 
+// Loads the program from the cache, or starts compiling and linking it
+GLuint SubmitProgram(const std::vector<ShaderStage> &stages,
+                     const std::string &program_name) {
+  std::vector<std::string> sources;
+  bool cacheable = ProgramBinariesSupported();
+  for (const ShaderStage &stage : stages) {
+    sources.push_back(ReadShader(stage.path, stage.defines));
+    cacheable = cacheable && !sources.back().empty();
+  }
+
+  std::filesystem::path cache_path;
+  if (cacheable) {
+    cache_path = CachePath(stages, sources);
+    if (GLuint program = LoadCachedProgram(cache_path))
+      return program;
+  }
+
+  EnableParallelCompile();
+  PendingProgram pending{program_name, {}, cache_path};
   GLuint program = glCreateProgram();
-  glAttachShader(program, vertexShader);
-  glAttachShader(program, fragmentShader);
+  for (size_t i = 0; i < stages.size(); i++) {
+    GLuint shader = CompileSource(sources[i], stages[i].type);
+    pending.shaders.emplace_back(shader, stages[i].name);
+    glAttachShader(program, shader);
+  }
+  if (cacheable)
+    glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
   glLinkProgram(program);
-  checkCompileErrors(program, "RENDER PROGRAM");
 
-  glDeleteShader(vertexShader);
-  glDeleteShader(fragmentShader);
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  pendingPrograms[program] = std::move(pending);
+  return program;
+}
+
+} // namespace
+
+GLuint CompileShader(const std::string &relative_path, GLenum shader_type,
+                     const std::string &shader_name) {
+  GLuint shader = CompileSource(ReadShader(relative_path, {}), shader_type);
+  checkCompileErrors(shader, shader_name);
+  return shader;
+}
 
+GLuint submitRenderProgram(const std::string &vertexPath,
+                           const std::string &fragmentPath) {
+  return SubmitProgram({{GL_VERTEX_SHADER, vertexPath, "VERTEX", {}},
+                        {GL_FRAGMENT_SHADER, fragmentPath, "FRAGMENT", {}}},
+                       "RENDER PROGRAM");
+}
+
+GLuint submitLineProgram(const std::string &vertexPath,
+                         const std::string &fragmentPath) {
+  return SubmitProgram(
+      {{GL_VERTEX_SHADER, vertexPath, "WIREFRAME VERTEX", {}},
+       {GL_FRAGMENT_SHADER, fragmentPath, "WIREFRAME FRAGMENT", {}}},
+      "WIREFRAME PROGRAM");
+}
+
+GLuint submitComputeProgram(const std::string &path, const char *name,
+                            const ShaderDefines &defines) {
+  return SubmitProgram({{GL_COMPUTE_SHADER, path, name, defines}},
+                       std::string(name) + " PROGRAM");
+}
+
+bool programReady(GLuint program) {
+  if (!ParallelCompileSupported())
+    return true;
+  GLint done = GL_TRUE;
+  glGetProgramiv(program, GL_COMPLETION_STATUS_ARB, &done);
+  return done == GL_TRUE;
+}
+
+void finishProgram(GLuint program) {
+  PendingProgram pending;
+  {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    auto it = pendingPrograms.find(program);
+    if (it == pendingPrograms.end())
+      return; // loaded from the cache, or finished already
+    pending = std::move(it->second);
+    pendingPrograms.erase(it);
+  }
+  for (const auto &shader : pending.shaders) {
+    checkCompileErrors(shader.first, shader.second);
+    glDeleteShader(shader.first);
+  }
+  checkCompileErrors(program, pending.name);
+  if (!pending.cache_path.empty())
+    StoreCachedProgram(pending.cache_path, program);
+}
+
+GLuint createRenderProgram(const std::string &vertexPath,
+                           const std::string &fragmentPath) {
+  GLuint program = submitRenderProgram(vertexPath, fragmentPath);
+  finishProgram(program);
   return program;
 }
 
 GLuint createLineProgram(const std::string &vertexPath,
                          const std::string &fragmentPath) {
-  GLuint lineVertexShader =
-      CompileShader(vertexPath, GL_VERTEX_SHADER, "WIREFRAME VERTEX");
-  GLuint lineFragmentShader =
-      CompileShader(fragmentPath, GL_FRAGMENT_SHADER, "WIREFRAME FRAGMENT");
-  GLuint program = glCreateProgram();
-  glAttachShader(program, lineVertexShader);
-  glAttachShader(program, lineFragmentShader);
-  glLinkProgram(program);
-  checkCompileErrors(program, "WIREFRAME PROGRAM");
-  glDeleteShader(lineVertexShader);
-  glDeleteShader(lineFragmentShader);
+  GLuint program = submitLineProgram(vertexPath, fragmentPath);
+  finishProgram(program);
+  return program;
+}
+
+GLuint createComputeProgram(const std::string &path, const char *name) {
+  GLuint program = submitComputeProgram(path, name);
+  finishProgram(program);
   return program;
 }
 
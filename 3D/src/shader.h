@@ -1,19 +1,33 @@
 #pragma once
 #include <GL/glew.h>
+#include <map>
 #include <string>
 
-// Shader paths, relative to the executable's directory. CMake copies the
-// shader sources next to the binary at build time.
+// Shader paths. The build embeds these files into the binaries
+// (embedded_shaders.h); with SPH_SHADER_DIR set they are read from disk
+// instead, relative to that directory (e.g. the 3D source dir).
 
 // SPH compute pipeline
 const std::string externalShaderSource = "src/shaders/simulation/external.compute";
+const std::string externalCountShaderSource = "src/shaders/simulation/external_count.compute";
 const std::string countShaderSource = "src/shaders/simulation/count.compute";
+const std::string countSharedShaderSource = "src/shaders/simulation/count_shared.compute";
 const std::string scanBlocksShaderSource = "src/shaders/simulation/scan_blocks.compute";
 const std::string scanSumsShaderSource = "src/shaders/simulation/scan_sums.compute";
 const std::string scanAddShaderSource = "src/shaders/simulation/scan_add.compute";
+const std::string scanLookbackShaderSource = "src/shaders/simulation/scan_lookback.compute";
+const std::string cellIdsShaderSource = "src/shaders/simulation/cell_ids.compute";
 const std::string scatterShaderSource = "src/shaders/simulation/scatter.compute";
 const std::string densityShaderSource = "src/shaders/simulation/density.compute";
 const std::string updateShaderSource = "src/shaders/simulation/update.compute";
+const std::string stepStatsShaderSource = "src/shaders/simulation/step_stats.compute";
+const std::string renderStateShaderSource = "src/shaders/simulation/render_state.compute";
+const std::string bricksMarkShaderSource = "src/shaders/simulation/bricks_mark.compute";
+const std::string bricksCompactShaderSource = "src/shaders/simulation/bricks_compact.compute";
+const std::string neighborListsShaderSource = "src/shaders/simulation/neighbor_lists.compute";
+// Particle buffer initialization and resizing (utilities.cpp)
+const std::string spawnParticlesShaderSource = "src/shaders/simulation/spawn_particles.compute";
+const std::string thinParticlesShaderSource = "src/shaders/simulation/thin_particles.compute";
 
 // Scene geometry (particle impostors, bounding cube, floor)
 const std::string vertexShaderSource = "src/shaders/scene/particle.vs";
@@ -32,10 +46,38 @@ const std::string thicknessFragmentSource = "src/shaders/fluid/thickness.fs";
 const std::string blurFragmentSource = "src/shaders/fluid/blur.fs";
 const std::string compositeFragmentSource = "src/shaders/fluid/composite.fs";
 
+// On-disk program binary cache (shader_cache/ next to the executable), on
+// unless the driver offers no binary formats. The create* functions below
+// load programs from it and fill it transparently.
+extern bool programBinaryCache;
+
+// Extra #defines for one variant of a shader, name -> value (may be empty).
+// The preprocessor injects them after the built-in ones, in name order, so
+// the same set always gives the same source and the same cache entry.
+using ShaderDefines = std::map<std::string, std::string>;
+
 GLuint createRenderProgram(const std::string &vertexPath,
                            const std::string &fragmentPath);
 GLuint createLineProgram(const std::string &vertexPath,
                          const std::string &fragmentPath);
+// `name` labels compile and link errors
+GLuint createComputeProgram(const std::string &path, const char *name);
+
+// The same, split in two so that many programs build at once. submit*
+// starts compiling and linking and returns without waiting on the driver,
+// which with GL_KHR/ARB_parallel_shader_compile works on its own threads.
+// finishProgram blocks until the program is linked, reports errors and fills
+// the cache; a program must be finished before use. programReady is true
+// once finishing will not wait; without the extension there is no way to
+// ask, and it is always true.
+GLuint submitRenderProgram(const std::string &vertexPath,
+                           const std::string &fragmentPath);
+GLuint submitLineProgram(const std::string &vertexPath,
+                         const std::string &fragmentPath);
+GLuint submitComputeProgram(const std::string &path, const char *name,
+                            const ShaderDefines &defines = {});
+bool programReady(GLuint program);
+void finishProgram(GLuint program);
 GLuint CompileShader(const std::string &relative_path, GLenum shader_type,
                      const std::string &shader_name);
 void checkCompileErrors(GLuint shader, std::string type);
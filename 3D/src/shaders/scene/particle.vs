@@ -3,10 +3,20 @@
 layout (location = 0) in vec2 quadVertex;     // Base quad vertex
 layout (location = 1) in vec4 instancePos;    // Per-instance position
 layout (location = 2) in vec4 instanceVel;    // Per-instance velocity
+// Render interpolation: the previous step's position, blended toward
+// instancePos by u_alpha. Unbound otherwise, with u_alpha = 1.
+layout (location = 3) in vec4 instancePrevPos;
 
 uniform mat4 u_proj;
 uniform mat4 u_view;
 uniform float sphereRadius;
+uniform float u_alpha;
+#ifdef COMPACT_PARTICLES
+// Positions arrive as normalized ushort4 over the simulation grid's AABB
+// (see particles.glsl); velocities as half4, which needs no decoding
+uniform vec3 quantMin;
+uniform vec3 quantExtent;
+#endif
 
 out vec2 texCoord;
 out vec3 viewCenter;
@@ -29,7 +39,11 @@ void main() {
 
     // Billboard directly in view space; the fragment shader reconstructs the
     // sphere surface from texCoord
-    viewCenter = (u_view * vec4(instancePos.xyz, 1.0)).xyz;
+    vec3 worldPos = mix(instancePrevPos.xyz, instancePos.xyz, u_alpha);
+#ifdef COMPACT_PARTICLES
+    worldPos = quantMin + worldPos * quantExtent;
+#endif
+    viewCenter = (u_view * vec4(worldPos, 1.0)).xyz;
     vec3 viewPos = viewCenter + vec3(quadVertex, 0.0) * sphereRadius;
     gl_Position = u_proj * vec4(viewPos, 1.0);
 
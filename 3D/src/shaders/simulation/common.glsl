@@ -2,16 +2,83 @@
 // by CompileShader). WORKGROUP_SIZE is injected by CompileShader from the
 // constant in simulation.h.
 //
-// Dense uniform grid over the world-space AABB of the simulation box. Cells
-// are indexed directly, so distinct cells never collide (unlike hashing).
+// Dense uniform grid over the world-space AABB of the simulation box (or the
+// box itself, with boxLocalGrid). Cells are indexed directly, so distinct
+// cells never collide (unlike hashing).
+//
+// Cells are numbered row-major (x fastest) by default. With mortonOrder they
+// follow a Morton / Z-order curve instead, so a cell's y and z neighbors are
+// usually near it in the cell tables and the sorted buffers too, not only its
+// x neighbors. Morton indices are sparse: the tables then cover every index
+// up to that of the far corner cell (see computeStepParams).
+//
+// With sparseGrid the grid is split into bricks of BRICK_SIZE^3 cells, and
+// only bricks holding particles get cell table entries: brickSlots maps each
+// brick (row-major over brickDims) to its slot of BRICK_CELLS entries, filled
+// in every step by bricks_mark and bricks_compact. Within a brick, cells are
+// numbered as above. Bricks beyond numBrickSlots share one overflow slot; its
+// cells then mix particles of several bricks, which are too far apart to
+// interact, so only the neighbor loops slow down.
+#define BRICK_SIZE 8
+#define BRICK_CELLS (BRICK_SIZE * BRICK_SIZE * BRICK_SIZE)
+#define NO_CELL 0xFFFFFFFFu // cell of an empty brick (sparse grid)
+
+layout(std430, binding = 20) buffer BrickSlots {
+    uint brickSlots[];
+};
+
+// Space the grid is laid out in: the world, or with boxLocalGrid the box's
+// own frame, where the grid keeps its size however the box is rotated.
+// boxTransform is rigid, so distances, and with them the neighbor cells,
+// are the same in both.
+vec3 ToGridSpace(vec3 pos)
+{
+    return boxLocalGrid ? (boxTransformInverse * vec4(pos, 1.0)).xyz : pos;
+}
 
+// Cell of a world-space position
 ivec3 GetCellCoord(vec3 pos, vec3 gridMin, float cellSize, ivec3 gridDims)
 {
-    return clamp(ivec3(floor((pos - gridMin) / cellSize)),
+    return clamp(ivec3(floor((ToGridSpace(pos) - gridMin) / cellSize)),
                  ivec3(0), gridDims - 1);
 }
 
+// Spreads the low 10 bits of v out to every third bit
+uint Part1By2(uint v)
+{
+    v &= 0x3FFu;
+    v = (v | (v << 16)) & 0x030000FFu;
+    v = (v | (v << 8)) & 0x0300F00Fu;
+    v = (v | (v << 4)) & 0x030C30C3u;
+    v = (v | (v << 2)) & 0x09249249u;
+    return v;
+}
+
+uint GetCellIndexInBlock(ivec3 cellCoord, ivec3 dims)
+{
+    if (mortonOrder)
+        return Part1By2(uint(cellCoord.x)) |
+               (Part1By2(uint(cellCoord.y)) << 1) |
+               (Part1By2(uint(cellCoord.z)) << 2);
+    return uint(cellCoord.x + dims.x * (cellCoord.y + dims.y * cellCoord.z));
+}
+
+// Row-major index of the brick holding a cell (sparse grid)
+uint GetBrickIndex(ivec3 cellCoord)
+{
+    ivec3 brick = cellCoord / BRICK_SIZE;
+    return uint(brick.x + brickDims.x * (brick.y + brickDims.y * brick.z));
+}
+
+// Cell table index of a cell; NO_CELL if it lies in an empty brick
 uint GetFlatCellIndex(ivec3 cellCoord, ivec3 gridDims)
 {
-    return uint(cellCoord.x + gridDims.x * (cellCoord.y + gridDims.y * cellCoord.z));
+    if (sparseGrid) {
+        uint slot = brickSlots[GetBrickIndex(cellCoord)];
+        if (slot == NO_CELL)
+            return NO_CELL;
+        return slot * uint(BRICK_CELLS) +
+               GetCellIndexInBlock(cellCoord % BRICK_SIZE, ivec3(BRICK_SIZE));
+    }
+    return GetCellIndexInBlock(cellCoord, gridDims);
 }
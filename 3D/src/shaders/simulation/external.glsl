@@ -0,0 +1,115 @@
+// External forces (gravity) and predicted positions, pulled in via
+// #include "external.glsl" (after common.glsl, particles.glsl and lists.glsl)
+// by external.compute and by the fused external_count.compute.
+// Under COMPACT_PARTICLES the stored positions are relative to last step's
+// box grid AABB, prevQuantMin/prevQuantExtent.
+
+layout(std430, binding = 0) buffer Positions {
+    PackedPosition positions[];
+};
+
+layout(std430, binding = 1) buffer Velocities {
+    PackedVelocity velocities[];
+};
+
+layout(std430, binding = 3) buffer PredictedPositions {
+    PackedPosition predictedPositions[];
+};
+
+// Applies gravity to particle id, stores its predicted position and returns
+// that position as stored
+vec4 ApplyExternalForces(uint id)
+{
+#ifdef COMPACT_PARTICLES
+    // Re-encode relative to this step's grid, which every later pass uses
+    vec4 pos = DecodePosition(positions[id], prevQuantMin, prevQuantExtent);
+    positions[id] = PackPosition(pos);
+#else
+    vec4 pos = positions[id];
+#endif
+
+    vec4 gravityAccel = vec4(0, -gravity / 100.0, 0, 0);
+    vec4 vel = UnpackVelocity(velocities[id]) + gravityAccel * deltaTime;
+    velocities[id] = PackVelocity(vel);
+
+    PackedPosition predicted = PackPosition(pos + vel * deltaTime);
+    predictedPositions[id] = predicted;
+    return UnpackPosition(predicted);
+}
+
+// Per-step reductions over the predicted positions, each compiled in by its
+// define. Each workgroup reduces in shared memory first, then issues one
+// global atomic per value.
+#if defined(PREDICTED_BOUNDS) || defined(NEIGHBOR_LISTS)
+#define GROUP_REDUCTIONS
+#endif
+
+#ifdef PREDICTED_BOUNDS
+// Fitted grid: the AABB of this step's predicted positions in grid space
+// (common.glsl), read back by the host to fit later steps' grids to the
+// fluid. Stored as order-preserving keys of the floats, those of the min
+// inverted, so that a slot cleared to zero is empty and both ends reduce
+// with atomicMax.
+layout(std430, binding = 22) buffer PredictedBounds {
+    uint predictedBounds[6]; // ~min key xyz, max key xyz
+};
+
+uint OrderedKey(float f)
+{
+    uint bits = floatBitsToUint(f);
+    return (bits & 0x80000000u) != 0u ? ~bits : bits | 0x80000000u;
+}
+#endif
+
+#ifdef NEIGHBOR_LISTS
+// Neighbor lists (lists.glsl): each particle's predicted position when the
+// lists were last built, against which this step's displacement is measured
+layout(std430, binding = 24) buffer ListReference {
+    vec4 referencePositions[];
+};
+#endif
+
+#ifdef GROUP_REDUCTIONS
+// Bounds keys as predictedBounds, then the largest squared displacement
+// (non-negative float bits order as uints)
+shared uint groupReductions[7];
+
+// Call from every invocation, before any AddToGroupReductions
+void BeginGroupReductions()
+{
+    if (gl_LocalInvocationID.x < 7u)
+        groupReductions[gl_LocalInvocationID.x] = 0u;
+    barrier();
+}
+
+void AddToGroupReductions(uint id, vec3 pos)
+{
+#ifdef PREDICTED_BOUNDS
+    vec3 gridPos = ToGridSpace(pos);
+    for (int a = 0; a < 3; a++) {
+        uint key = OrderedKey(gridPos[a]);
+        atomicMax(groupReductions[a], ~key);
+        atomicMax(groupReductions[3 + a], key);
+    }
+#endif
+#ifdef NEIGHBOR_LISTS
+    vec3 moved = pos - referencePositions[id].xyz;
+    atomicMax(groupReductions[6], floatBitsToUint(dot(moved, moved)));
+#endif
+}
+
+// Call from every invocation, after its AddToGroupReductions
+void EndGroupReductions()
+{
+    barrier();
+    uint t = gl_LocalInvocationID.x;
+#ifdef PREDICTED_BOUNDS
+    if (t < 6u && groupReductions[t] != 0u)
+        atomicMax(predictedBounds[t], groupReductions[t]);
+#endif
+#ifdef NEIGHBOR_LISTS
+    if (t == 6u)
+        atomicMax(maxDisplacement2, groupReductions[6]);
+#endif
+}
+#endif
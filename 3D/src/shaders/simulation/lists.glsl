@@ -0,0 +1,46 @@
+// Verlet neighbor lists, pulled in via #include "lists.glsl" by the passes
+// that sort, build or read them.
+//
+// With neighborLists, neighbor_lists.compute stores for every particle the
+// sorted indices of all particles within listRadius = h + skin of it, itself
+// included, in one flat array (CSR layout: listRanges[id] is its start and
+// count there). Density and update then loop over that list instead of the
+// cell walk. Each step the external pass reduces how far any predicted
+// position has moved since the lists were built; while that stays within
+// skin / 2, no two particles can have closed in by more than the skin, so
+// the lists still hold every neighbor within h, and the whole cell sort is
+// skipped: the count and scan passes return at once, and scatter copies the
+// particles to the same index, keeping the order the lists refer to.
+//
+// The decision is made on the GPU, from the reduction, so the host issues
+// the same passes every step and never waits on it.
+#define NO_LIST 0xFFFFFFFFu // count of a particle whose list did not fit
+
+// Cleared by the host every step: maxDisplacement2 and listOverflow of this
+// step's parity. listOverflow[listParity ^ 1] is the previous step's.
+layout(std430, binding = 23) coherent buffer ListState {
+    uint maxDisplacement2; // float bits, as in external.glsl
+    uint listOverflow[2];  // set by a build that ran out of capacity
+};
+
+layout(std430, binding = 25) buffer ListRanges {
+    uvec2 listRanges[];
+};
+
+layout(std430, binding = 26) buffer ListNeighbors {
+    uint listNeighbors[];
+};
+
+// Whether this step sorts the particles (and rebuilds the lists): always
+// without lists, else when the host asks for it, when the last build ran out
+// of capacity, or when a particle moved more than skin / 2. Non-negative
+// float bits order as uints, so a NaN displacement forces a rebuild too.
+bool SortThisStep()
+{
+    if (!neighborLists || forceListRebuild)
+        return true;
+    if (listOverflow[listParity ^ 1] != 0u)
+        return true;
+    float skin = listRadius - smoothingRadius;
+    return maxDisplacement2 > floatBitsToUint(0.25 * skin * skin);
+}
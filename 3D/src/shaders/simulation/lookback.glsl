@@ -0,0 +1,39 @@
+// Decoupled look-back (Merrill & Garland 2016), pulled in via
+// #include "lookback.glsl" by the single-pass scans after they declare
+// scanState: [0] is a tile counter and [1 + tile] the state of each tile,
+// all cleared before the dispatch. Tiles are numbered in the order
+// workgroups start rather than by gl_WorkGroupID, so every tile a workgroup
+// waits on is already running.
+#define SCAN_BLOCK (WORKGROUP_SIZE * 2)
+
+// Tile state: value in the low 30 bits, flag in the top two. 0 means the
+// tile has published nothing yet.
+#define FLAG_AGGREGATE 0x40000000u // tile total only
+#define FLAG_PREFIX    0x80000000u // inclusive prefix through this tile
+#define VALUE_MASK     0x3FFFFFFFu
+
+// Publishes the total of `tile`, then walks back over its predecessors'
+// published values until it reaches an inclusive prefix, and returns the
+// sum of all tiles before it. Called by one invocation per workgroup.
+uint LookBack(uint tile, uint aggregate)
+{
+    if (tile == 0u) {
+        atomicExchange(scanState[1], FLAG_PREFIX | aggregate);
+        return 0u;
+    }
+    atomicExchange(scanState[1u + tile], FLAG_AGGREGATE | aggregate);
+
+    // scanState[j] is the state of tile j - 1. Tile 0 always ends up with a
+    // prefix, so this terminates.
+    uint prefix = 0u;
+    uint j = tile;
+    for (;;) {
+        uint state = atomicOr(scanState[j], 0u);
+        if (state == 0u) continue; // not published yet
+        prefix += state & VALUE_MASK;
+        if ((state & FLAG_PREFIX) != 0u) break;
+        j--;
+    }
+    atomicExchange(scanState[1u + tile], FLAG_PREFIX | (prefix + aggregate));
+    return prefix;
+}
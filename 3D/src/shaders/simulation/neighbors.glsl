@@ -0,0 +1,99 @@
+// Neighbor-range lookup over the cell tables, pulled in via
+// #include "neighbors.glsl" by the density, update and neighbor list passes
+// after their cellStart/cellEnd declarations.
+//
+// Row mode (the default): x is the fastest axis of GetFlatCellIndex and the
+// scatter pass lays cells out in index order, so the up to three x-adjacent
+// cells of each (y, z) row are one contiguous slice of the sorted buffers,
+// [cellStart[first], cellEnd[last]). That is 9 table lookups and bounds
+// checks per particle instead of 27. Only valid for row-major cell numbering
+// of the whole grid, so the host clears rowRanges in Morton and sparse mode.
+//
+// reach is the walk's radius in cells: 1 for the h-sized cells' 3x3x3 block,
+// more for the wider neighbor list radius (lists.glsl). Ranges come in the
+// same order at any reach, z outermost, so the neighbors within h of a
+// particle are visited in the same order too.
+
+int NeighborRangeCount(int reach)
+{
+    int width = 2 * reach + 1;
+    return rowRanges ? width * width : width * width * width;
+}
+
+// Sorted-index range [start, end) of neighbor range r around cellCoord,
+// empty if it lies outside the grid
+void GetNeighborRange(ivec3 cellCoord, ivec3 gridDims, int reach, int r,
+                      out uint start, out uint end)
+{
+    start = 0u;
+    end = 0u;
+    int width = 2 * reach + 1;
+    if (rowRanges) {
+        ivec3 row = cellCoord + ivec3(0, r % width, r / width) - reach;
+        if (row.y < 0 || row.z < 0 || row.y >= gridDims.y || row.z >= gridDims.z)
+            return;
+        int x0 = max(cellCoord.x - reach, 0);
+        int x1 = min(cellCoord.x + reach, gridDims.x - 1);
+        start = cellStart[GetFlatCellIndex(ivec3(x0, row.yz), gridDims)];
+        end = cellEnd[GetFlatCellIndex(ivec3(x1, row.yz), gridDims)];
+    } else {
+        ivec3 neighborCoord = cellCoord +
+            ivec3(r % width, (r / width) % width, r / (width * width)) - reach;
+        if (any(lessThan(neighborCoord, ivec3(0))) ||
+            any(greaterThanEqual(neighborCoord, gridDims)))
+            return;
+        uint cell = GetFlatCellIndex(neighborCoord, gridDims);
+        if (cell == NO_CELL)
+            return;
+        start = cellStart[cell];
+        end = cellEnd[cell];
+    }
+}
+
+// GetNeighborRange narrowed to the cells that can hold a point within radius
+// of gridPos (the particle in grid space, see ToGridSpace): a wide walk then
+// skips most of the cells in the corners of its block, and trims each row to
+// the span the sphere covers. The position is clamped into the grid first,
+// as the cell coordinates are, so no particle clamped into a border cell is
+// missed.
+void GetNeighborRangeWithin(vec3 gridPos, float radius, ivec3 cellCoord,
+                            ivec3 gridDims, int reach, int r,
+                            out uint start, out uint end)
+{
+    start = 0u;
+    end = 0u;
+    int width = 2 * reach + 1;
+    ivec3 lo, hi;
+    if (rowRanges) {
+        lo = cellCoord + ivec3(0, r % width, r / width) - reach;
+        hi = ivec3(cellCoord.x + reach, lo.yz);
+    } else {
+        lo = cellCoord +
+            ivec3(r % width, (r / width) % width, r / (width * width)) - reach;
+        hi = lo;
+    }
+    lo = max(lo, ivec3(0));
+    hi = min(hi, gridDims - 1);
+    if (any(greaterThan(lo, hi)))
+        return;
+
+    // Distance to the range's cells across y and z, then the x span left
+    float h = smoothingRadius;
+    vec3 p = clamp(gridPos - gridMin, vec3(0.0), vec3(gridDims) * h);
+    vec3 gap = max(max(vec3(lo) * h - p, p - vec3(hi + 1) * h), vec3(0.0));
+    float left = radius * radius - gap.y * gap.y - gap.z * gap.z;
+    if (left <= 0.0)
+        return;
+    float span = sqrt(left);
+    lo.x = max(lo.x, int(floor((p.x - span) / h)));
+    hi.x = min(hi.x, int(floor((p.x + span) / h)));
+    if (lo.x > hi.x)
+        return;
+
+    uint first = GetFlatCellIndex(lo, gridDims);
+    uint last = GetFlatCellIndex(hi, gridDims);
+    if (first == NO_CELL)
+        return;
+    start = cellStart[first];
+    end = cellEnd[last];
+}
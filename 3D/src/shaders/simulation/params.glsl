@@ -0,0 +1,41 @@
+// Per-step simulation parameters, pulled in via #include "params.glsl" first
+// by every compute pass. One std140 block, written once per step into a slot
+// of a persistently mapped ring and bound to binding 0 (SimParamsBlock in
+// simulation.cpp mirrors this layout; keep the two in sync).
+layout(std140, binding = 0) uniform SimParams {
+    mat4 boxTransform;
+    mat4 boxTransformInverse;
+    vec3 gridMin;
+    float smoothingRadius;
+    ivec3 gridDims;
+    int numParticles;
+    // Compact particle storage: this step's and last step's grid AABB
+    vec3 quantMin;
+    float deltaTime;
+    vec3 quantExtent;
+    float gravity;
+    vec3 prevQuantMin;
+    int numCells;   // cell table size
+    vec3 prevQuantExtent;
+    int numBlocks;  // scan blocks over numCells
+    float botX, botY, botZ, topX;
+    float topY, topZ, targetDensity, pressureStrength;
+    float nearPressureStrength, viscosityStrength;
+    float SpikyPow2ScalingFactor, SpikyPow3ScalingFactor;
+    float Poly6ScalingFactor;
+    float SpikyPow2DerivativeScalingFactor, SpikyPow3DerivativeScalingFactor;
+    int tileCells;
+    bool mortonOrder, rowRanges, tiled, stableOrder;
+    bool trackIds;  // carry persistent particle IDs (render interpolation)
+    bool sparseGrid;  // brick-sparse cell tables (common.glsl)
+    int numBrickSlots;  // cell table bricks, not counting the overflow one
+    bool boxLocalGrid;  // grid in the box's frame (common.glsl)
+    ivec3 brickDims;
+    int numBricks;  // bricks in brickDims
+    bool neighborLists;  // Verlet neighbor lists (lists.glsl)
+    bool forceListRebuild;
+    int listParity;  // alternates every step
+    float listRadius;  // h + skin
+    int listCapacity;  // listNeighbors entries
+    int listReach;  // cells the list build walks around a particle
+};
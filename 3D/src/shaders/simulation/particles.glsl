@@ -0,0 +1,54 @@
+// Particle storage layout, pulled in via #include "particles.glsl" by every
+// pass that touches positions, velocities or predicted positions (and their
+// sorted copies).
+//
+// Default: one vec4 per particle and attribute. With COMPACT_PARTICLES
+// (injected by PreprocessShader when compactParticles is set) positions are
+// four 16-bit unorms over the grid AABB (quantMin + u * quantExtent) and
+// velocities four half floats: 8 bytes instead of 16, in the same layout
+// setupQuadBuffers feeds to the renderer as ushort4/half4 attributes. The
+// fourth component is padding; positions decode with w = 1, velocities
+// with w = 0, as the full-precision path keeps them.
+#ifdef COMPACT_PARTICLES
+
+#define PackedPosition uvec2
+#define PackedVelocity uvec2
+
+vec4 DecodePosition(uvec2 p, vec3 frameMin, vec3 frameExtent)
+{
+    vec3 u = vec3(unpackUnorm2x16(p.x), unpackUnorm2x16(p.y).x);
+    return vec4(frameMin + u * frameExtent, 1.0);
+}
+
+vec4 UnpackPosition(uvec2 p)
+{
+    return DecodePosition(p, quantMin, quantExtent);
+}
+
+uvec2 PackPosition(vec4 pos)
+{
+    vec3 u = (pos.xyz - quantMin) / quantExtent;
+    return uvec2(packUnorm2x16(u.xy), packUnorm2x16(vec2(u.z, 0.0)));
+}
+
+vec4 UnpackVelocity(uvec2 v)
+{
+    return vec4(unpackHalf2x16(v.x), unpackHalf2x16(v.y).x, 0.0);
+}
+
+uvec2 PackVelocity(vec4 vel)
+{
+    return uvec2(packHalf2x16(vel.xy), packHalf2x16(vec2(vel.z, 0.0)));
+}
+
+#else
+
+#define PackedPosition vec4
+#define PackedVelocity vec4
+
+vec4 UnpackPosition(vec4 p) { return p; }
+vec4 PackPosition(vec4 pos) { return pos; }
+vec4 UnpackVelocity(vec4 v) { return v; }
+vec4 PackVelocity(vec4 vel) { return vel; }
+
+#endif
@@ -0,0 +1,346 @@
+#include "sim_thread.h"
+#include "cpu_simulation.h"
+#include "utilities.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+bool simulationThread = false;
+std::atomic<float> simThreadStepRate{0.0f};
+
+extern ParticleBuffers particleBuffers;
+extern std::unique_ptr<SimulationBackend> simulation;
+
+namespace {
+
+// Three slots: the newest published state, the one the renderer is drawing,
+// and one to copy the next state into without waiting on either
+const int PUBLISH_SLOTS = 3;
+
+struct PublishSlot {
+  GLuint positions = 0, velocities = 0;
+  GLsync written = nullptr; // copy into the slot, simulation context
+  GLsync drawn = nullptr;   // last frame that drew the slot, main context
+  int count = 0;
+  glm::vec3 quantMin, quantExtent;
+  glm::vec3 boxMin, boxMax;
+  glm::mat4 boxTransform;
+  SimulationReadout readout;
+  int generation = 0; // bumped whenever the slot's buffers are recreated
+};
+
+GLFWwindow *simWindow = nullptr;
+std::thread worker;
+std::atomic<bool> stopRequested{false};
+bool useCpu = false;
+
+// Settings handed over by the main thread, under settingsMutex
+std::mutex settingsMutex;
+SimulationSettings submittedSettings;
+bool settingsSubmitted = false;
+bool respawnRequested = false;
+
+// Slot bookkeeping, shared by both threads under publishMutex
+std::mutex publishMutex;
+std::condition_variable publishedCond;
+PublishSlot slots[PUBLISH_SLOTS];
+int latestSlot = -1;
+int readingSlot = -1;
+
+// Main context: one instanced quad VAO per slot, rebuilt when the slot's
+// buffers change (VAOs are not shared between contexts)
+GLuint slotVAO[PUBLISH_SLOTS], slotQuadVBO[PUBLISH_SLOTS];
+int slotVAOGeneration[PUBLISH_SLOTS] = {-1, -1, -1};
+
+GLint64 bufferSize(GLuint buffer) {
+  GLint64 size = 0;
+  glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+  glGetBufferParameteri64v(GL_COPY_READ_BUFFER, GL_BUFFER_SIZE, &size);
+  return size;
+}
+
+void deleteSlotSyncs(PublishSlot &slot) {
+  if (slot.written)
+    glDeleteSync(slot.written);
+  if (slot.drawn)
+    glDeleteSync(slot.drawn);
+  slot.written = slot.drawn = nullptr;
+}
+
+// (Re)creates the slots at the size of the current particle buffers. Any
+// frame still drawing an old slot keeps its buffers alive through its VAO.
+// Call with publishMutex held, and publish into the new slots before
+// releasing it: the main thread must never find latestSlot at -1 once
+// the first state is out.
+void createSlotsLocked() {
+  GLint64 size = bufferSize(particleBuffers.positions);
+  for (PublishSlot &slot : slots) {
+    deleteSlotSyncs(slot);
+    glDeleteBuffers(1, &slot.positions);
+    glDeleteBuffers(1, &slot.velocities);
+    GLuint *buffers[] = {&slot.positions, &slot.velocities};
+    for (GLuint *buffer : buffers) {
+      glGenBuffers(1, buffer);
+      glBindBuffer(GL_COPY_WRITE_BUFFER, *buffer);
+      glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STREAM_COPY);
+    }
+    slot.generation++;
+  }
+  latestSlot = -1;
+}
+
+void deleteSlots() {
+  std::lock_guard<std::mutex> lock(publishMutex);
+  for (PublishSlot &slot : slots) {
+    deleteSlotSyncs(slot);
+    glDeleteBuffers(1, &slot.positions);
+    glDeleteBuffers(1, &slot.velocities);
+    slot.positions = slot.velocities = 0;
+  }
+}
+
+// What the main thread draws around and shows with the slot's state: the
+// box and readout of the thread's latest step
+void describeState(PublishSlot &slot) {
+  slot.count = numParticles;
+  slot.quantMin = quantMin;
+  slot.quantExtent = quantExtent;
+  slot.boxMin = glm::vec3(botX, botY, botZ);
+  slot.boxMax = glm::vec3(topX, topY, topZ);
+  slot.boxTransform = boxTransform;
+  slot.readout = currentSimulationReadout();
+}
+
+// Copies the state the last step left in the particle buffers into a free
+// slot and makes it the newest one. Returns the copy's fence. Call with
+// publishMutex held.
+GLsync publishStateLocked() {
+  int target = 0;
+  while (target == latestSlot || target == readingSlot)
+    target++;
+  PublishSlot &slot = slots[target];
+
+  // The GPU (not this thread) waits for the last frame that drew the slot
+  if (slot.drawn) {
+    glWaitSync(slot.drawn, 0, GL_TIMEOUT_IGNORED);
+    glDeleteSync(slot.drawn);
+    slot.drawn = nullptr;
+  }
+  if (slot.written)
+    glDeleteSync(slot.written);
+
+  GLsizeiptr size = particleAttribBytes(numParticles);
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+  glBindBuffer(GL_COPY_READ_BUFFER, particleBuffers.positions);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, slot.positions);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size);
+  glBindBuffer(GL_COPY_READ_BUFFER, particleBuffers.velocities);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, slot.velocities);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size);
+  slot.written = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  // The main context waits on the fence, so it has to reach the GPU
+  glFlush();
+
+  describeState(slot);
+  latestSlot = target;
+  publishedCond.notify_all();
+  return slot.written;
+}
+
+GLsync publishState() {
+  std::lock_guard<std::mutex> lock(publishMutex);
+  return publishStateLocked();
+}
+
+// Settings applied without a step (paused, or short of a whole step of
+// wall time): the newest state stays, in the new box
+void redescribeLatestState() {
+  std::lock_guard<std::mutex> lock(publishMutex);
+  describeState(slots[latestSlot]);
+}
+
+// New slots and their first state in one critical section
+void createSlotsAndPublish() {
+  std::lock_guard<std::mutex> lock(publishMutex);
+  createSlotsLocked();
+  publishStateLocked();
+}
+
+void createParticleState() {
+  createParticleBuffers(&particleBuffers);
+  simulation->resetParticles();
+  createSlotsAndPublish();
+}
+
+void resizeParticleState(bool respawn) {
+  GLuint positions = particleBuffers.positions;
+  resizeParticleBuffers(&particleBuffers, respawn);
+  simulation->resetParticles();
+  // Slots are as large as the particle buffers
+  if (particleBuffers.positions != positions)
+    createSlotsAndPublish();
+  else
+    publishState();
+}
+
+// Applies the settings the main thread handed over since the last call,
+// resizing the particle state to their count (or respawning it) first.
+// false if there were none.
+bool applySubmittedSettings(bool *resized) {
+  SimulationSettings settings;
+  bool respawn;
+  {
+    std::lock_guard<std::mutex> lock(settingsMutex);
+    if (!settingsSubmitted)
+      return false;
+    settings = submittedSettings;
+    respawn = respawnRequested;
+    settingsSubmitted = respawnRequested = false;
+  }
+  *resized = respawn || settings.numParticles != numParticles;
+  applySimulationSettings(settings);
+  if (*resized)
+    resizeParticleState(respawn);
+  return true;
+}
+
+void threadMain() {
+  glfwMakeContextCurrent(simWindow);
+  if (useCpu)
+    simulation = std::make_unique<CpuSimulation>(&particleBuffers);
+  else
+    simulation = std::make_unique<GpuSimulation>();
+  createParticleState();
+
+  // Fence of the previous publish: waiting on it before the next step keeps
+  // at most one step queued behind the one the GPU is running. The slot it
+  // belongs to is never the copy target of the very next publish.
+  GLsync inFlight = nullptr;
+  double lastTime = glfwGetTime();
+  double rateStart = lastTime;
+  int rateSteps = 0;
+  while (!stopRequested) {
+    bool resized = false;
+    bool applied = applySubmittedSettings(&resized);
+    // The resize published a state: its slot may be the next copy target
+    // now, or deleted with the old slots
+    if (resized)
+      inFlight = nullptr;
+
+    // Steps run on the thread's own globals, with no lock held
+    int steps = 0;
+    GLsync fence = nullptr;
+    double now = glfwGetTime();
+    if (realTimeStepping) {
+      steps = stepRealTime(*simulation, now - lastTime);
+    } else {
+      // Free-running: one step per iteration, as fast as the GPU allows
+      steps = running ? 1 : 0;
+      simulation->step();
+    }
+    lastTime = now;
+    if (steps > 0)
+      fence = publishState();
+    else if (applied && !resized)
+      redescribeLatestState();
+
+    rateSteps += steps;
+    if (now - rateStart >= 1.0) {
+      simThreadStepRate = (float)(rateSteps / (now - rateStart));
+      rateSteps = 0;
+      rateStart = now;
+    }
+
+    if (steps == 0) {
+      // Paused, or not a whole step of wall time yet
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+    if (inFlight)
+      glClientWaitSync(inFlight, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+    inFlight = fence;
+  }
+
+  simulation.reset();
+  deleteParticleBuffers(&particleBuffers);
+  deleteSlots();
+  glFinish();
+  glfwMakeContextCurrent(nullptr);
+}
+
+} // namespace
+
+bool startSimulationThread(GLFWwindow *mainWindow, bool useCpuBackend) {
+  // Same context hints as the main window, which it shares objects with
+  glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+  simWindow = glfwCreateWindow(1, 1, "", nullptr, mainWindow);
+  glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+  if (!simWindow)
+    return false;
+
+  useCpu = useCpuBackend;
+  stopRequested = false;
+  worker = std::thread(threadMain);
+  std::unique_lock<std::mutex> lock(publishMutex);
+  publishedCond.wait(lock, [] { return latestSlot >= 0; });
+  return true;
+}
+
+void stopSimulationThread() {
+  if (!worker.joinable())
+    return;
+  stopRequested = true;
+  worker.join();
+  for (int i = 0; i < PUBLISH_SLOTS; i++) {
+    glDeleteVertexArrays(1, &slotVAO[i]);
+    glDeleteBuffers(1, &slotQuadVBO[i]);
+    slotVAOGeneration[i] = -1;
+  }
+  glfwDestroyWindow(simWindow);
+  simWindow = nullptr;
+}
+
+void submitSimulationSettings(const SimulationSettings &settings,
+                              bool respawn) {
+  std::lock_guard<std::mutex> lock(settingsMutex);
+  submittedSettings = settings;
+  settingsSubmitted = true;
+  respawnRequested = respawnRequested || respawn;
+}
+
+ParticleDrawState acquirePublishedState(SimulationReadout *readout) {
+  std::lock_guard<std::mutex> lock(publishMutex);
+  // Set before startSimulationThread returned, and slots are only ever
+  // recreated together with their first publish
+  int i = latestSlot;
+  readingSlot = i;
+  PublishSlot &slot = slots[i];
+  // Orders this frame's draws after the copy, without blocking the CPU
+  glWaitSync(slot.written, 0, GL_TIMEOUT_IGNORED);
+  if (slotVAOGeneration[i] != slot.generation) {
+    glDeleteVertexArrays(1, &slotVAO[i]);
+    glDeleteBuffers(1, &slotQuadVBO[i]);
+    setupQuadBuffers(&slotVAO[i], &slotQuadVBO[i], slot.positions,
+                     slot.velocities);
+    slotVAOGeneration[i] = slot.generation;
+  }
+  *readout = slot.readout;
+  return {slotVAO[i], slot.count, slot.quantMin, slot.quantExtent, 1.0f,
+          slot.boxMin, slot.boxMax, slot.boxTransform};
+}
+
+void releasePublishedState() {
+  std::lock_guard<std::mutex> lock(publishMutex);
+  if (readingSlot < 0)
+    return;
+  PublishSlot &slot = slots[readingSlot];
+  if (slot.drawn)
+    glDeleteSync(slot.drawn);
+  slot.drawn = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  // The simulation context waits on the fence before reusing the slot
+  glFlush();
+  readingSlot = -1;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "renderer.h" // GLEW before any GL header
+#include "simulation.h"
+#include <GLFW/glfw3.h>
+#include <atomic>
+
+// Decoupled simulation thread (--sim-thread). The simulation steps on its own
+// thread, in a hidden window's GL context shared with the main one, and
+// publishes each finished state into a ring of three position/velocity
+// buffer pairs. A fence on every copy and on every frame that draws a slot
+// keeps the two contexts from stepping on each other; the renderer always
+// draws the newest finished state, so neither side's frame time throttles
+// the other.
+//
+// While the thread runs, the simulation's globals are its own. The main
+// thread edits a SimulationSettings copy and hands it over between steps,
+// and draws and shows only what the thread published, so the two share
+// nothing but a settings copy and the slots, each under a short lock.
+//
+// The particle buffers and the backend are created (and destroyed) on that
+// thread: SSBO bindings and timer queries are per-context state.
+extern bool simulationThread;
+// Steps per second the thread managed over the last second
+extern std::atomic<float> simThreadStepRate;
+
+// Creates the shared context, starts the thread and waits for the initial
+// state to be published. false when the context could not be created.
+bool startSimulationThread(GLFWwindow *mainWindow, bool useCpuBackend);
+void stopSimulationThread();
+
+// Hands the main thread's settings to the thread, which applies them (and
+// resizes the particle buffers to their numParticles) before its next step.
+// A respawn request sticks until then.
+void submitSimulationSettings(const SimulationSettings &settings,
+                              bool respawn);
+
+// Newest published state, with its VAO in the calling (main) context, and
+// what the GUI shows of the steps that led to it. The slot stays reserved
+// until releasePublishedState, which fences the draws issued in between.
+ParticleDrawState acquirePublishedState(SimulationReadout *readout);
+void releasePublishedState();
@@ -1,13 +1,45 @@
 #include "simulation.h"
 #include "shader.h"
 #define _USE_MATH_DEFINES
+#include <algorithm>
 #include <cfloat>
 #include <cmath>
+#include <cstring>
+#include <map>
+#include <vector>
 
-GLuint computeProgram[8]{};
+GLuint computeProgram[NUM_COMPUTE_PROGRAMS]{};
 int numParticles = 32768 * 2 * 2;
 int pendingNumParticles = 32768 * 2 * 2;
+const float fixedDeltaTime = 1.0f / 120.0f; // simulation timestep
+bool adaptiveTimestep = false;
+float cflNumber = 0.4f;
+float simDeltaTime = fixedDeltaTime;
+bool fluidStatistics = false;
+FluidStats fluidStats{};
+bool running = true;
 float smoothingRadius = 0.011f;
+float targetDensity = 3.75f;
+float pressureStrength = 27.0f;
+float nearPressureStrength = 0.022f;
+float viscosityStrength = 0.03f;
+float gravity = 9.8f;
+bool neighborRowRanges = true;
+bool tiledNeighborGather = false;
+bool singlePassScan = true;
+bool sharedCountHistogram = false;
+bool deterministicScatter = false;
+bool mortonCellOrder = false;
+bool compactParticles = false;
+bool fusedExternalCount = false;
+bool sparseBrickGrid = false;
+bool fittedGrid = false;
+bool boxLocalGrid = false;
+bool neighborLists = false;
+float neighborSkin = 0.4f;
+float listRebuildRate = 0.0f;
+bool renderInterpolation = false;
+glm::vec3 quantMin(0.0f), quantExtent(1.0f);
 float botX = 0.0f;
 float botY = 0.0f;
 float topX = 0.4f;
@@ -16,6 +48,11 @@ float botZ = 0.0f;
 float topZ = 0.3f;
 glm::mat4 boxTransform = glm::mat4(1.0f);
 glm::mat4 boxTransformInverse = glm::mat4(1.0f);
+bool realTimeStepping = false;
+float stepBudgetMs = 12.0f;
+int maxSubstepsPerFrame = 8;
+int lastSubsteps = 0;
+double simBacklogSeconds = 0.0, simDroppedSeconds = 0.0;
 
 const char *gpuPassNames[GPU_PASS_COUNT] = {"External", "Count",   "Scan",
                                             "Scatter",  "Density", "Update"};
@@ -26,56 +63,222 @@ namespace {
 // A scan_blocks workgroup scans two cells per thread
 const int SCAN_BLOCK = 2 * WORKGROUP_SIZE;
 
-// Per-frame uniform locations, fetched once at setup. Constant uniforms
-// (numParticles, deltaTime) are uploaded once and on particle-count changes.
-struct {
-  GLint gravity;
-} externalU;
-struct {
-  GLint smoothingRadius, gridMin, gridDims;
-} countU;
-struct {
-  GLint numCells;
-} scanBlocksU;
-struct {
-  GLint numBlocks;
-} scanSumsU;
-struct {
-  GLint numCells;
-} scanAddU;
-struct {
-  GLint smoothingRadius, gridMin, gridDims;
-  GLint spikyPow2, spikyPow3;
-} densityU;
-struct {
-  GLint smoothingRadius, gridMin, gridDims;
-  GLint targetDensity, pressureStrength, nearPressureStrength,
-      viscosityStrength;
-  GLint botX, botY, topX, topY, botZ, topZ;
-  GLint spikyPow2Derivative, spikyPow3Derivative, poly6;
-  GLint boxTransform, boxTransformInverse;
-} updateU;
+// x-cells per workgroup in the tiled density/update passes. Wider blocks
+// share each staged row among more particles, but every particle then also
+// tests the (TILE_CELLS + 2) / 3 times wider rows.
+const int TILE_CELLS = 4;
+
+// Host mirror of the std140 SimParams block in params.glsl: every per-step
+// uniform of every pass, written once per step
+struct SimParamsBlock {
+  glm::mat4 boxTransform;
+  glm::mat4 boxTransformInverse;
+  glm::vec3 gridMin;
+  float smoothingRadius;
+  glm::ivec3 gridDims;
+  int numParticles;
+  glm::vec3 quantMin;
+  float deltaTime;
+  glm::vec3 quantExtent;
+  float gravity;
+  glm::vec3 prevQuantMin;
+  int numCells;
+  glm::vec3 prevQuantExtent;
+  int numBlocks;
+  float botX, botY, botZ, topX;
+  float topY, topZ, targetDensity, pressureStrength;
+  float nearPressureStrength, viscosityStrength;
+  float spikyPow2Scale, spikyPow3Scale;
+  float poly6Scale;
+  float spikyPow2DerivScale, spikyPow3DerivScale;
+  int tileCells;
+  uint32_t mortonOrder, rowRanges, tiled, stableOrder; // GLSL bools
+  uint32_t trackIds, sparseGrid;
+  int numBrickSlots;
+  uint32_t boxLocalGrid;
+  glm::ivec3 brickDims;
+  int numBricks;
+  uint32_t neighborLists, forceListRebuild;
+  int listParity;
+  float listRadius;
+  int listCapacity, listReach;
+  int pad[2];
+};
+static_assert(sizeof(SimParamsBlock) == 368, "std140 layout of SimParams");
+
+// SimParams ring: each step writes the next of PARAMS_RING_SLOTS slots and
+// binds it to uniform binding 0. The slots are persistently mapped where
+// ARB_buffer_storage is available (a plain memcpy per step), else updated
+// with glBufferSubData. A fence per slot keeps the CPU from overwriting a
+// slot the GPU may still read, several steps later.
+const int PARAMS_RING_SLOTS = 4;
+GLuint paramsBuffer;
+GLsizeiptr paramsSlotStride = 0;
+char *paramsMapped = nullptr;
+GLsync paramsFences[PARAMS_RING_SLOTS] = {};
+int paramsSlot = 0;
+
+// Fluid statistics readback ring: step_stats reduces into this step's slot
+// and a fence marks it; later steps take the newest slot whose fence has
+// signaled, never waiting on one. Persistently mapped where
+// ARB_buffer_storage is available, else read with glGetBufferSubData once
+// the fence has signaled. The per-workgroup partials live in their own
+// buffer (binding 15), grown with the particle count.
+const int STATS_RING_SLOTS = 4;
+const int STATS_VEC4S = 4; // as in step_stats.compute
+struct StepStatsBlock {
+  float stats[STATS_VEC4S][4];
+  uint32_t groupsDone;
+};
+GLuint statsBuffer, statsPartialsBuffer;
+int statsPartialsCapacity = 0; // workgroups
+GLsizeiptr statsSlotStride = 0;
+const char *statsMapped = nullptr;
+GLsync statsFences[STATS_RING_SLOTS] = {};
+long statsStep[STATS_RING_SLOTS] = {}; // step each pending slot belongs to
+long statsStepCounter = 0;
+int statsSlot = 0;
 
 int gridCellCapacity = GRID_CELL_CAPACITY;
 // Per-cell tables (owned here; particle buffers are owned by main/utilities):
 // cellStart  - first sorted index of each cell (exclusive prefix sum)
-// cellEnd    - particle counts, then scatter cursors, then cell ends
-// blockSums  - scan auxiliary (one partial sum per SCAN_BLOCK cells)
+// cellEnd    - particle counts, then cell ends (cellStart + count)
+// blockSums  - scan auxiliary: one partial sum per SCAN_BLOCK cells for the
+//              three-pass scan, or a tile counter followed by one tile state
+//              per SCAN_BLOCK cells for the single-pass scan
 GLuint cellStartBuffer, cellEndBuffer, blockSumsBuffer;
 
-// Double-buffered GL_TIME_ELAPSED queries; results are read one frame late so
-// the CPU never stalls waiting on the GPU.
-GLuint timerQueries[2][GPU_PASS_COUNT];
-long timedFrames = 0;
+// A few words a pass writes for the host to read a step or more later,
+// without ever waiting on the GPU (the statistics ring, with its mapped
+// slots and partials, is its own). Each step writes the next slot, cleared
+// to zero first, and fences it; if every slot is still in flight it writes
+// a spare one that is never read instead.
+const int READBACK_RING_SLOTS = 4;
+struct ReadbackRing {
+  GLuint buffer = 0;
+  GLsizeiptr size = 0, stride = 0;
+  GLsync fences[READBACK_RING_SLOTS] = {};
+  long steps[READBACK_RING_SLOTS] = {}; // step each pending slot belongs to
+  long stepCounter = 0;
+  int slot = 0;   // last slot written and fenced
+  int target = 0; // slot this step writes
+};
+
+// Sparse grid. The brick table (binding 20) holds a flag, then a cell table
+// slot, per brick of the grid; it is as large as the dense grid's brick
+// count, 1/512 of its cells. bricks_compact numbers the bricks with a
+// look-back scan whose tile states live in brickScanBuffer (binding 28), and
+// stores the occupied brick count into brickCountRing (binding 21). The cell
+// tables are given a slot for
+// each brick of the newest count plus headroom for the fluid spreading, and
+// one overflow slot shared by any bricks beyond those.
+const int BRICK_SIZE = 8; // as in common.glsl
+const int BRICK_CELLS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+GLuint brickTableBuffer, brickScanBuffer;
+int brickTableCapacity = 0; // bricks
+ReadbackRing brickCountRing;
+int occupiedBricks = -1; // newest readback, -1 before the first
+
+// Fitted grid: the external pass reduces the predicted positions' AABB in
+// grid space into boundsRing (binding 22, order-preserving keys as in
+// external.glsl). fluidBounds is the newest readback, until the mode is
+// turned off, the grid changes space or the particles are reset.
+const int FIT_MARGIN_CELLS = 2;
+ReadbackRing boundsRing;
+bool fluidBoundsValid = false;
+bool fluidBoundsBoxLocal = false; // space of the pending and valid bounds
+glm::vec3 fluidBoundsMin, fluidBoundsMax;
 
-GLuint createComputeProgram(const std::string &source, const char *name) {
-  GLuint program = glCreateProgram();
-  glAttachShader(program, CompileShader(source, GL_COMPUTE_SHADER, name));
-  glLinkProgram(program);
-  checkCompileErrors(program, std::string(name) + " PROGRAM");
+// Neighbor lists (lists.glsl). listStateBuffer (binding 23) holds the
+// displacement reduction and the overflow flags, listReferenceBuffer (24)
+// the positions of the last build, listRangesBuffer (25) and
+// listNeighborsBuffer (26) the lists themselves. The build stores the
+// entries it needed into listTotalRing (binding 27), 0 if it did not run;
+// the capacity grows to a quarter over the newest total, and until one has
+// arrived it is a guess per particle.
+const int LIST_ENTRIES_PER_PARTICLE = 40;
+GLuint listStateBuffer, listReferenceBuffer, listRangesBuffer,
+    listNeighborsBuffer;
+int listParticleCapacity = 0; // particles
+int listCapacity = 0;         // listNeighbors entries
+ReadbackRing listTotalRing;
+// Whether the lists describe the current particles, and at what radius
+bool listsValid = false;
+float listsRadius = 0.0f;
+int listParity = 0;
+
+// Source and error label of each computeProgram slot
+const struct {
+  const std::string &source;
+  const char *name;
+} COMPUTE_PASSES[NUM_COMPUTE_PROGRAMS] = {
+    {externalShaderSource, "EXTERNAL"},
+    {densityShaderSource, "DENSITY"},
+    {updateShaderSource, "UPDATE"},
+    {countShaderSource, "COUNT"},
+    {scanBlocksShaderSource, "SCAN BLOCKS"},
+    {scanSumsShaderSource, "SCAN SUMS"},
+    {scanAddShaderSource, "SCAN ADD"},
+    {scatterShaderSource, "SCATTER"},
+    {scanLookbackShaderSource, "SCAN LOOKBACK"},
+    {countSharedShaderSource, "COUNT SHARED"},
+    {cellIdsShaderSource, "CELL IDS"},
+    {externalCountShaderSource, "EXTERNAL COUNT"},
+    {stepStatsShaderSource, "STEP STATS"},
+    {renderStateShaderSource, "RENDER STATE"},
+    {bricksMarkShaderSource, "BRICKS MARK"},
+    {bricksCompactShaderSource, "BRICKS COMPACT"},
+    {neighborListsShaderSource, "NEIGHBOR LISTS"},
+};
+
+// Compute passes specialized at compile time by extra #defines, for
+// parameters that rarely change, by pass and define set. computeProgram[i]
+// is the general variant of pass i, with no defines.
+std::map<std::pair<int, ShaderDefines>, GLuint> programVariants;
+
+GLuint submitVariant(int pass, const ShaderDefines &defines) {
+  return submitComputeProgram(COMPUTE_PASSES[pass].source,
+                              COMPUTE_PASSES[pass].name, defines);
+}
+
+// Pass `pass` specialized by `defines`. A set used for the first time is
+// compiled right there (or loaded from the program binary cache).
+GLuint programVariant(int pass, const ShaderDefines &defines) {
+  if (defines.empty())
+    return computeProgram[pass];
+  GLuint &program = programVariants[{pass, defines}];
+  if (!program) {
+    program = submitVariant(pass, defines);
+    finishProgram(program);
+  }
   return program;
 }
 
+// The update pass's variant for the current parameters. An unrotated box
+// collides in world space, without the two mat4 transforms each way.
+ShaderDefines updateDefines() {
+  ShaderDefines defines;
+  if (boxTransform == glm::mat4(1.0f))
+    defines["AXIS_ALIGNED_BOX"] = "";
+  return defines;
+}
+
+// The external passes' variant: the fitted grid's bounds reduction and the
+// neighbor lists' displacement reduction are compiled in only while on
+ShaderDefines externalDefines() {
+  ShaderDefines defines;
+  if (fittedGrid)
+    defines["PREDICTED_BOUNDS"] = "";
+  if (neighborLists)
+    defines["NEIGHBOR_LISTS"] = "";
+  return defines;
+}
+
+// Double-buffered GL_TIME_ELAPSED queries; results are read a step late, and
+// only once available, so the CPU never stalls waiting on the GPU.
+GLuint timerQueries[2][GPU_PASS_COUNT];
+long timedFrames = 0;
+
 void allocateGridBuffers() {
   glBindBuffer(GL_SHADER_STORAGE_BUFFER, cellStartBuffer);
   glBufferData(GL_SHADER_STORAGE_BUFFER, gridCellCapacity * sizeof(uint32_t),
@@ -87,98 +290,596 @@ void allocateGridBuffers() {
                nullptr, GL_DYNAMIC_COPY);
   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, cellEndBuffer);
 
-  int maxBlocks = gridCellCapacity / SCAN_BLOCK + 1;
+  int maxBlocks = gridCellCapacity / SCAN_BLOCK + 2;
   glBindBuffer(GL_SHADER_STORAGE_BUFFER, blockSumsBuffer);
   glBufferData(GL_SHADER_STORAGE_BUFFER, maxBlocks * sizeof(uint32_t), nullptr,
                GL_DYNAMIC_COPY);
   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, blockSumsBuffer);
 }
 
-} // namespace
+// Zeroes the counts of this step's cells, not the whole table: a grid that
+// shrank (or a fitted one) leaves the rest of the capacity unused
+void clearCellCounts(int cellCount) {
+  uint32_t zero = 0;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, cellEndBuffer);
+  glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0,
+                       cellCount * sizeof(uint32_t), GL_RED_INTEGER,
+                       GL_UNSIGNED_INT, &zero);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
 
-void updateNumParticlesUniform() {
-  for (int i = 0; i < 8; i++) {
-    GLint loc = glGetUniformLocation(computeProgram[i], "numParticles");
-    if (loc != -1) {
-      glUseProgram(computeProgram[i]);
-      glUniform1i(loc, numParticles);
+void createParamsRing() {
+  GLint alignment = 256;
+  glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+  paramsSlotStride =
+      (sizeof(SimParamsBlock) + alignment - 1) / alignment * alignment;
+  GLsizeiptr size = paramsSlotStride * PARAMS_RING_SLOTS;
+
+  glGenBuffers(1, &paramsBuffer);
+  glBindBuffer(GL_UNIFORM_BUFFER, paramsBuffer);
+  if (GLEW_ARB_buffer_storage) {
+    GLbitfield flags =
+        GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_UNIFORM_BUFFER, size, nullptr, flags);
+    paramsMapped =
+        (char *)glMapBufferRange(GL_UNIFORM_BUFFER, 0, size, flags);
+  } else {
+    glBufferData(GL_UNIFORM_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+  }
+}
+
+// Writes this step's parameters into the next ring slot and binds it
+void uploadSimParams(const SimParamsBlock &block) {
+  paramsSlot = (paramsSlot + 1) % PARAMS_RING_SLOTS;
+  GLintptr offset = paramsSlot * paramsSlotStride;
+  if (paramsMapped) {
+    if (GLsync fence = paramsFences[paramsSlot]) {
+      GLenum status;
+      do {
+        status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+      } while (status == GL_TIMEOUT_EXPIRED);
+      glDeleteSync(fence);
+      paramsFences[paramsSlot] = nullptr;
     }
+    memcpy(paramsMapped + offset, &block, sizeof(block));
+  } else {
+    glBindBuffer(GL_UNIFORM_BUFFER, paramsBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, offset, sizeof(block), &block);
   }
+  glBindBufferRange(GL_UNIFORM_BUFFER, 0, paramsBuffer, offset,
+                    sizeof(block));
 }
 
-void setupComputeShaders() {
-  computeProgram[0] = createComputeProgram(externalShaderSource, "EXTERNAL");
-  computeProgram[1] = createComputeProgram(densityShaderSource, "DENSITY");
-  computeProgram[2] = createComputeProgram(updateShaderSource, "UPDATE");
-  computeProgram[3] = createComputeProgram(countShaderSource, "COUNT");
-  computeProgram[4] =
-      createComputeProgram(scanBlocksShaderSource, "SCAN BLOCKS");
-  computeProgram[5] = createComputeProgram(scanSumsShaderSource, "SCAN SUMS");
-  computeProgram[6] = createComputeProgram(scanAddShaderSource, "SCAN ADD");
-  computeProgram[7] = createComputeProgram(scatterShaderSource, "SCATTER");
-
-  // Constant uniforms, set once
-  updateNumParticlesUniform();
-  for (int i = 0; i < 8; i++) {
-    GLint deltaTimeLoc = glGetUniformLocation(computeProgram[i], "deltaTime");
-    if (deltaTimeLoc != -1) {
-      glUseProgram(computeProgram[i]);
-      glUniform1f(deltaTimeLoc, fixedDeltaTime);
+void createStatsRing() {
+  GLint alignment = 256;
+  glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+  statsSlotStride =
+      (sizeof(StepStatsBlock) + alignment - 1) / alignment * alignment;
+  GLsizeiptr size = statsSlotStride * STATS_RING_SLOTS;
+
+  glGenBuffers(1, &statsBuffer);
+  glGenBuffers(1, &statsPartialsBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, statsBuffer);
+  if (GLEW_ARB_buffer_storage) {
+    GLbitfield flags =
+        GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_SHADER_STORAGE_BUFFER, size, nullptr, flags);
+    statsMapped = (const char *)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0,
+                                                 size, flags);
+  } else {
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, nullptr, GL_DYNAMIC_READ);
+  }
+}
+
+// Reduces this step's statistics into the next free ring slot. Skipped if
+// every slot is still in flight (the GPU is more than STATS_RING_SLOTS steps
+// behind), rather than waiting for one.
+void runStepStats(int numWorkGroups) {
+  int slot = (statsSlot + 1) % STATS_RING_SLOTS;
+  if (statsFences[slot])
+    return;
+  statsSlot = slot;
+
+  if (numWorkGroups > statsPartialsCapacity) {
+    statsPartialsCapacity = numWorkGroups;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, statsPartialsBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 statsPartialsCapacity * STATS_VEC4S * 4 * sizeof(float),
+                 nullptr, GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, statsPartialsBuffer);
+  }
+
+  GLintptr offset = slot * statsSlotStride;
+  uint32_t zero = 0;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, statsBuffer);
+  glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, offset,
+                       sizeof(StepStatsBlock), GL_RED_INTEGER,
+                       GL_UNSIGNED_INT, &zero);
+  glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 14, statsBuffer, offset,
+                    sizeof(StepStatsBlock));
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+  glUseProgram(computeProgram[12]);
+  glDispatchCompute(numWorkGroups, 1, 1);
+  glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT |
+                  GL_BUFFER_UPDATE_BARRIER_BIT);
+  statsFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  statsStep[slot] = statsStepCounter++;
+}
+
+// Collects every slot whose fence has signaled and keeps the newest result.
+// Returns false if none was ready.
+bool pollStepStats() {
+  long newest = -1;
+  for (int slot = 0; slot < STATS_RING_SLOTS; slot++) {
+    GLsync &fence = statsFences[slot];
+    if (!fence)
+      continue;
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+      continue;
+    glDeleteSync(fence);
+    fence = nullptr;
+    if (statsStep[slot] < newest)
+      continue;
+    newest = statsStep[slot];
+
+    StepStatsBlock stats;
+    GLintptr offset = slot * statsSlotStride;
+    if (statsMapped) {
+      memcpy(&stats, statsMapped + offset, sizeof(stats));
+    } else {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, statsBuffer);
+      glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, sizeof(stats),
+                         &stats);
+    }
+    fluidStats.valid = true;
+    fluidStats.maxSpeed = stats.stats[0][0];
+    fluidStats.maxAcceleration = stats.stats[0][1];
+    fluidStats.kineticEnergy = stats.stats[0][2];
+    fluidStats.meanDensityError = stats.stats[1][0];
+    fluidStats.maxDensityError = stats.stats[1][1];
+    fluidStats.boundsMin = glm::vec3(stats.stats[2][0], stats.stats[2][1],
+                                     stats.stats[2][2]);
+    fluidStats.boundsMax = glm::vec3(stats.stats[3][0], stats.stats[3][1],
+                                     stats.stats[3][2]);
+  }
+  return newest >= 0;
+}
+
+void createReadbackRing(ReadbackRing &ring, GLsizeiptr size) {
+  GLint alignment = 256;
+  glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+  ring.size = size;
+  ring.stride = (size + alignment - 1) / alignment * alignment;
+  glGenBuffers(1, &ring.buffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, ring.buffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER,
+               ring.stride * (READBACK_RING_SLOTS + 1), nullptr,
+               GL_DYNAMIC_READ);
+}
+
+// Drops the pending slots, for readbacks that went stale
+void discardReadbacks(ReadbackRing &ring) {
+  for (GLsync &fence : ring.fences) {
+    glDeleteSync(fence);
+    fence = nullptr;
+  }
+}
+
+void deleteReadbackRing(ReadbackRing &ring) {
+  discardReadbacks(ring);
+  glDeleteBuffers(1, &ring.buffer);
+  ring.buffer = 0;
+}
+
+// Picks this step's slot, clears it and binds it to `binding`
+void beginReadback(ReadbackRing &ring, GLuint binding) {
+  int slot = (ring.slot + 1) % READBACK_RING_SLOTS;
+  ring.target = ring.fences[slot] ? READBACK_RING_SLOTS : slot;
+  uint32_t zero = 0;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, ring.buffer);
+  glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI,
+                       ring.target * ring.stride, ring.size, GL_RED_INTEGER,
+                       GL_UNSIGNED_INT, &zero);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  glBindBufferRange(GL_SHADER_STORAGE_BUFFER, binding, ring.buffer,
+                    ring.target * ring.stride, ring.size);
+}
+
+// Fences this step's slot, after the pass that writes it
+void endReadback(ReadbackRing &ring) {
+  if (ring.target == READBACK_RING_SLOTS)
+    return;
+  ring.slot = ring.target;
+  ring.fences[ring.slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  ring.steps[ring.slot] = ring.stepCounter++;
+}
+
+// Copies the newest slot whose fence has signaled into data. Returns false
+// if none had.
+bool pollReadback(ReadbackRing &ring, void *data) {
+  long newest = -1;
+  for (int slot = 0; slot < READBACK_RING_SLOTS; slot++) {
+    GLsync &fence = ring.fences[slot];
+    if (!fence)
+      continue;
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+      continue;
+    glDeleteSync(fence);
+    fence = nullptr;
+    if (ring.steps[slot] < newest)
+      continue;
+    newest = ring.steps[slot];
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ring.buffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, slot * ring.stride,
+                       ring.size, data);
+  }
+  return newest >= 0;
+}
+
+// Inverse of OrderedKey in external.glsl
+float orderedKeyToFloat(uint32_t key) {
+  uint32_t bits = (key & 0x80000000u) ? key & 0x7FFFFFFFu : ~key;
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Takes the newest predicted-position AABB that has arrived, if any
+void pollFluidBounds() {
+  uint32_t keys[6];
+  if (!pollReadback(boundsRing, keys) || keys[3] == 0)
+    return;
+  for (int a = 0; a < 3; a++) {
+    fluidBoundsMin[a] = orderedKeyToFloat(~keys[a]);
+    fluidBoundsMax[a] = orderedKeyToFloat(keys[3 + a]);
+  }
+  fluidBoundsValid = true;
+}
+
+void allocateBrickTable(int numBricks) {
+  brickTableCapacity = numBricks + numBricks / 2;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, brickTableBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, brickTableCapacity * sizeof(uint32_t),
+               nullptr, GL_DYNAMIC_COPY);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 20, brickTableBuffer);
+
+  int maxTiles = brickTableCapacity / SCAN_BLOCK + 2;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, brickScanBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, maxTiles * sizeof(uint32_t), nullptr,
+               GL_DYNAMIC_COPY);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 28, brickScanBuffer);
+}
+
+void createBrickBuffers() {
+  glGenBuffers(1, &brickTableBuffer);
+  glGenBuffers(1, &brickScanBuffer);
+  createReadbackRing(brickCountRing, sizeof(uint32_t));
+  // Bound from the start: every pass including common.glsl declares it
+  allocateBrickTable(1);
+}
+
+// Cell table bricks for this step: the newest occupied count, a quarter
+// more and a few spare for the fluid to spread into until the next
+// readback. Before the first one, as many as the initial cell tables hold.
+int brickSlots(int numBricks) {
+  int slots = GRID_CELL_CAPACITY / BRICK_CELLS - 1;
+  if (occupiedBricks >= 0)
+    slots = occupiedBricks + occupiedBricks / 4 + 8;
+  return std::min(slots, numBricks);
+}
+
+// Flags and numbers this step's occupied bricks (sparse grid)
+void runBrickPasses(int numBricks, int numWorkGroups) {
+  uint32_t zero = 0;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, brickTableBuffer);
+  glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0,
+                       numBricks * sizeof(uint32_t), GL_RED_INTEGER,
+                       GL_UNSIGNED_INT, &zero);
+  int numTiles = (numBricks + SCAN_BLOCK - 1) / SCAN_BLOCK;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, brickScanBuffer);
+  glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0,
+                       (numTiles + 1) * sizeof(uint32_t), GL_RED_INTEGER,
+                       GL_UNSIGNED_INT, &zero);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+  glUseProgram(computeProgram[14]);
+  glDispatchCompute(numWorkGroups, 1, 1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+  beginReadback(brickCountRing, 21);
+  glUseProgram(computeProgram[15]);
+  glDispatchCompute(numTiles, 1, 1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT |
+                  GL_BUFFER_UPDATE_BARRIER_BIT);
+  endReadback(brickCountRing);
+}
+
+// Sizes the list buffers for `particles` particles and `entries` list
+// entries. Their contents are lost, so the next step rebuilds.
+void allocateListBuffers(int particles, int entries) {
+  listParticleCapacity = particles;
+  listCapacity = entries;
+  GLuint buffers[] = {listReferenceBuffer, listRangesBuffer,
+                      listNeighborsBuffer};
+  GLsizeiptr sizes[] = {particles * (GLsizeiptr)sizeof(glm::vec4),
+                        particles * 2 * (GLsizeiptr)sizeof(uint32_t),
+                        entries * (GLsizeiptr)sizeof(uint32_t)};
+  for (int i = 0; i < 3; i++) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[i]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizes[i], nullptr,
+                 GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 24 + i, buffers[i]);
+  }
+  listsValid = false;
+}
+
+void createListBuffers() {
+  glGenBuffers(1, &listStateBuffer);
+  glGenBuffers(1, &listReferenceBuffer);
+  glGenBuffers(1, &listRangesBuffer);
+  glGenBuffers(1, &listNeighborsBuffer);
+  uint32_t state[3] = {};
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, listStateBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(state), state,
+               GL_DYNAMIC_COPY);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 23, listStateBuffer);
+  createReadbackRing(listTotalRing, sizeof(uint32_t));
+  // Bound from the start: the sort, density and update passes declare them
+  // in every mode
+  allocateListBuffers(1, 1);
+}
+
+// Grows the list buffers to the particle count and the newest total, and
+// clears this step's displacement and overflow flag. Returns whether the
+// lists have to be rebuilt whatever the displacement.
+bool prepareNeighborLists(float listRadius) {
+  uint32_t total;
+  if (pollReadback(listTotalRing, &total)) {
+    listRebuildRate += ((total > 0 ? 1.0f : 0.0f) - listRebuildRate) * 0.05f;
+    if ((int64_t)total > listCapacity)
+      allocateListBuffers(std::max(numParticles, listParticleCapacity),
+                          (int)(total + total / 4));
+  }
+  if (numParticles > listParticleCapacity)
+    allocateListBuffers(numParticles,
+                        std::max(listCapacity,
+                                 numParticles * LIST_ENTRIES_PER_PARTICLE));
+
+  listParity ^= 1;
+  uint32_t zero = 0;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, listStateBuffer);
+  glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0,
+                       sizeof(uint32_t), GL_RED_INTEGER, GL_UNSIGNED_INT,
+                       &zero);
+  glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI,
+                       (1 + listParity) * sizeof(uint32_t), sizeof(uint32_t),
+                       GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+  bool force = !listsValid || listRadius != listsRadius;
+  listsValid = true;
+  listsRadius = listRadius;
+  return force;
+}
+
+// Render interpolation state. The scatter pass moves the persistent IDs from
+// binding 16 into sorted order at binding 17, where the render state pass
+// reads them; the two buffers then swap roles for the next step.
+GLuint particleIdBuffers[2];
+GLuint renderPositionBuffers[2], renderVelocityBuffer;
+int renderStateCapacity = 0;
+int renderNewest = 0;
+int renderStatesWritten = 0; // 0, 1 (newest only) or 2 (both)
+int renderStateGeneration = 0;
+bool idsTracked = false;
+
+// (Re)starts ID tracking: any labeling works as long as it persists, so
+// the IDs start out as the particles' current indices
+void startIdTracking() {
+  if (numParticles > renderStateCapacity) {
+    renderStateCapacity = numParticles;
+    GLuint *buffers[] = {&particleIdBuffers[0], &particleIdBuffers[1],
+                         &renderPositionBuffers[0], &renderPositionBuffers[1],
+                         &renderVelocityBuffer};
+    GLsizeiptr sizes[] = {sizeof(uint32_t), sizeof(uint32_t),
+                          sizeof(glm::vec4), sizeof(glm::vec4),
+                          sizeof(glm::vec4)};
+    for (int i = 0; i < 5; i++) {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, *buffers[i]);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, renderStateCapacity * sizes[i],
+                   nullptr, GL_DYNAMIC_COPY);
     }
+    renderStateGeneration++;
   }
+  std::vector<uint32_t> ids(numParticles);
+  for (int i = 0; i < numParticles; i++)
+    ids[i] = i;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleIdBuffers[0]);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, numParticles * sizeof(uint32_t),
+                  ids.data());
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, particleIdBuffers[0]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, particleIdBuffers[1]);
+  renderStatesWritten = 0;
+  idsTracked = true;
+}
 
-  externalU.gravity = glGetUniformLocation(computeProgram[0], "gravity");
-
-  countU.smoothingRadius =
-      glGetUniformLocation(computeProgram[3], "smoothingRadius");
-  countU.gridMin = glGetUniformLocation(computeProgram[3], "gridMin");
-  countU.gridDims = glGetUniformLocation(computeProgram[3], "gridDims");
-
-  scanBlocksU.numCells = glGetUniformLocation(computeProgram[4], "numCells");
-  scanSumsU.numBlocks = glGetUniformLocation(computeProgram[5], "numBlocks");
-  scanAddU.numCells = glGetUniformLocation(computeProgram[6], "numCells");
-
-  densityU.smoothingRadius =
-      glGetUniformLocation(computeProgram[1], "smoothingRadius");
-  densityU.gridMin = glGetUniformLocation(computeProgram[1], "gridMin");
-  densityU.gridDims = glGetUniformLocation(computeProgram[1], "gridDims");
-  densityU.spikyPow2 =
-      glGetUniformLocation(computeProgram[1], "SpikyPow2ScalingFactor");
-  densityU.spikyPow3 =
-      glGetUniformLocation(computeProgram[1], "SpikyPow3ScalingFactor");
-
-  updateU.smoothingRadius =
-      glGetUniformLocation(computeProgram[2], "smoothingRadius");
-  updateU.gridMin = glGetUniformLocation(computeProgram[2], "gridMin");
-  updateU.gridDims = glGetUniformLocation(computeProgram[2], "gridDims");
-  updateU.targetDensity =
-      glGetUniformLocation(computeProgram[2], "targetDensity");
-  updateU.pressureStrength =
-      glGetUniformLocation(computeProgram[2], "pressureStrength");
-  updateU.nearPressureStrength =
-      glGetUniformLocation(computeProgram[2], "nearPressureStrength");
-  updateU.viscosityStrength =
-      glGetUniformLocation(computeProgram[2], "viscosityStrength");
-  updateU.botX = glGetUniformLocation(computeProgram[2], "botX");
-  updateU.botY = glGetUniformLocation(computeProgram[2], "botY");
-  updateU.topX = glGetUniformLocation(computeProgram[2], "topX");
-  updateU.topY = glGetUniformLocation(computeProgram[2], "topY");
-  updateU.botZ = glGetUniformLocation(computeProgram[2], "botZ");
-  updateU.topZ = glGetUniformLocation(computeProgram[2], "topZ");
-  updateU.spikyPow2Derivative = glGetUniformLocation(
-      computeProgram[2], "SpikyPow2DerivativeScalingFactor");
-  updateU.spikyPow3Derivative = glGetUniformLocation(
-      computeProgram[2], "SpikyPow3DerivativeScalingFactor");
-  updateU.poly6 = glGetUniformLocation(computeProgram[2], "Poly6ScalingFactor");
-  updateU.boxTransform =
-      glGetUniformLocation(computeProgram[2], "boxTransform");
-  updateU.boxTransformInverse =
-      glGetUniformLocation(computeProgram[2], "boxTransformInverse");
+// Writes this step's particles at their IDs into the older render buffer,
+// which becomes the newest. The first step after (re)starting fills both.
+void runRenderState(int numWorkGroups) {
+  renderNewest ^= 1;
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18,
+                   renderPositionBuffers[renderNewest]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 19, renderVelocityBuffer);
+  glUseProgram(computeProgram[13]);
+  glDispatchCompute(numWorkGroups, 1, 1);
+  glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT |
+                  GL_BUFFER_UPDATE_BARRIER_BIT);
+  if (renderStatesWritten == 0) {
+    glBindBuffer(GL_COPY_READ_BUFFER, renderPositionBuffers[renderNewest]);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, renderPositionBuffers[renderNewest ^ 1]);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                        numParticles * sizeof(glm::vec4));
+  }
+  renderStatesWritten = std::min(renderStatesWritten + 1, 2);
+
+  std::swap(particleIdBuffers[0], particleIdBuffers[1]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, particleIdBuffers[0]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, particleIdBuffers[1]);
+}
+
+// CFL bound on the next step's dt from the latest step statistics
+float adaptiveDeltaTime() {
+  float h = smoothingRadius;
+  float dt = 2.0f * fixedDeltaTime;
+  if (fluidStats.maxSpeed > 0.0f)
+    dt = std::min(dt, cflNumber * h / fluidStats.maxSpeed);
+  if (fluidStats.maxAcceleration > 0.0f)
+    dt = std::min(dt, cflNumber * std::sqrt(h / fluidStats.maxAcceleration));
+  dt = std::min(dt, 1.1f * simDeltaTime);
+  return std::max(dt, 0.25f * fixedDeltaTime);
+}
 
+// Sets the grid and everything that depends on its dimensions
+void setStepGrid(StepParams &p, const glm::vec3 &gridMin,
+                 const glm::ivec3 &gridDims) {
+  p.gridMin = gridMin;
+  p.gridDims = gridDims;
+  p.cellCount = p.gridDims.x * p.gridDims.y * p.gridDims.z;
+
+  // Morton numbering needs each axis to fit its 10 bits, and leaves gaps:
+  // the tables must reach the index of the far corner cell
+  int maxDim = std::max(p.gridDims.x, std::max(p.gridDims.y, p.gridDims.z));
+  p.mortonOrder = mortonCellOrder && maxDim <= 1024;
+  if (p.mortonOrder)
+    p.cellCount = (int)MortonCellIndex(p.gridDims - 1) + 1;
+  p.rowRanges = neighborRowRanges && !p.mortonOrder;
+  p.tiledGather = tiledNeighborGather && !p.mortonOrder;
+}
+
+// Box-local grid: the box's own extents, padded by one cell like the world
+// grid
+void setBoxLocalGrid(StepParams &p) {
+  glm::vec3 gridMin = glm::vec3(botX, botY, botZ) - smoothingRadius;
+  glm::vec3 gridMax = glm::vec3(topX, topY, topZ) + smoothingRadius;
+  setStepGrid(p, gridMin,
+              glm::max(glm::ivec3(glm::ceil((gridMax - gridMin) /
+                                            smoothingRadius)),
+                       glm::ivec3(1)));
+}
+
+// Fitted grid: the box grid's cells around the fluid's latest AABB, widened
+// by FIT_MARGIN_CELLS for its movement since. Cell boundaries stay on the
+// box grid's lattice. A particle beyond the margin (the fluid moved faster)
+// is clamped into a border cell, which costs time but loses no neighbors:
+// clamping never moves two cells further apart.
+void fitGridToFluid(StepParams &p) {
+  float h = smoothingRadius;
+  glm::vec3 margin(FIT_MARGIN_CELLS * h);
+  glm::ivec3 first = glm::clamp(
+      glm::ivec3(glm::floor((fluidBoundsMin - margin - p.gridMin) / h)),
+      glm::ivec3(0), p.gridDims - 1);
+  glm::ivec3 last = glm::clamp(
+      glm::ivec3(glm::floor((fluidBoundsMax + margin - p.gridMin) / h)),
+      first, p.gridDims - 1);
+  setStepGrid(p, p.gridMin + glm::vec3(first) * h, last - first + 1);
+}
+
+// Density and update run one thread per particle, or in tiled mode one
+// workgroup per TILE_CELLS x-cells of each (y, z) row of the grid
+void dispatchNeighborPass(const StepParams &p, int numWorkGroups) {
+  if (p.tiledGather)
+    glDispatchCompute((p.gridDims.x + TILE_CELLS - 1) / TILE_CELLS,
+                      p.gridDims.y, p.gridDims.z);
+  else
+    glDispatchCompute(numWorkGroups, 1, 1);
+}
+
+} // namespace
+
+StepParams computeStepParams() {
+  StepParams p;
+
+  // Dense uniform grid over the world-space AABB of the (possibly rotated)
+  // box, padded by one cell so predicted positions that overshoot the bounds
+  // still land in a border cell. Direct indexing - no hash collisions.
+  glm::vec3 gridMin(FLT_MAX), gridMax(-FLT_MAX);
+  for (int corner = 0; corner < 8; corner++) {
+    glm::vec3 local((corner & 1) ? topX : botX, (corner & 2) ? topY : botY,
+                    (corner & 4) ? topZ : botZ);
+    glm::vec3 world = glm::vec3(boxTransform * glm::vec4(local, 1.0f));
+    gridMin = glm::min(gridMin, world);
+    gridMax = glm::max(gridMax, world);
+  }
+  gridMin -= smoothingRadius;
+  gridMax += smoothingRadius;
+  setStepGrid(p, gridMin,
+              glm::max(glm::ivec3(glm::ceil((gridMax - gridMin) /
+                                            smoothingRadius)),
+                       glm::ivec3(1)));
+
+  // 3D smoothing kernel normalization factors
+  double h = smoothingRadius;
+  p.spikyPow2Scale = (float)(15.0 / (2.0 * M_PI * pow(h, 5)));
+  p.spikyPow3Scale = (float)(15.0 / (M_PI * pow(h, 6)));
+  p.spikyPow2DerivScale = (float)(-15.0 / (M_PI * pow(h, 5)));
+  p.spikyPow3DerivScale = (float)(-45.0 / (M_PI * pow(h, 6)));
+  p.poly6Scale = (float)(315.0 / (64.0 * M_PI * pow(h, 9)));
+
+  // Slider calibration: the switch from the old 2D kernel normalization to
+  // proper 3D kernels rescales densities and forces by large, h-dependent
+  // factors. These conversions keep the GUI sliders in the effective range
+  // they were tuned for (and track h, so re-tuning isn't needed when the
+  // smoothing radius slider moves).
+  p.targetDensityEff = targetDensity * 12500.0f / smoothingRadius;
+  p.pressureStrengthEff = pressureStrength * smoothingRadius;
+  p.viscosityStrengthEff = viscosityStrength * 250.0f;
+  return p;
+}
+
+uint32_t MortonCellIndex(const glm::ivec3 &cellCoord) {
+  auto part1By2 = [](uint32_t v) {
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+  };
+  return part1By2(cellCoord.x) | (part1By2(cellCoord.y) << 1) |
+         (part1By2(cellCoord.z) << 2);
+}
+
+void setupComputeShaders() {
+  // All submitted before any is waited on, so they compile in parallel. The
+  // variants for the current parameters (the unrotated box by default) are
+  // built up front too.
+  for (int i = 0; i < NUM_COMPUTE_PROGRAMS; i++)
+    computeProgram[i] = submitVariant(i, {});
+  std::pair<int, ShaderDefines> initialVariants[] = {
+      {2, updateDefines()}, {0, externalDefines()}, {11, externalDefines()}};
+  for (const auto &variant : initialVariants)
+    if (!variant.second.empty())
+      programVariants[variant] = submitVariant(variant.first, variant.second);
+  for (GLuint program : computeProgram)
+    finishProgram(program);
+  for (const auto &variant : programVariants)
+    finishProgram(variant.second);
+
+  createParamsRing();
+  createStatsRing();
   glGenBuffers(1, &cellStartBuffer);
   glGenBuffers(1, &cellEndBuffer);
   glGenBuffers(1, &blockSumsBuffer);
   allocateGridBuffers();
+  createBrickBuffers();
+  createReadbackRing(boundsRing, 6 * sizeof(uint32_t));
+  createListBuffers();
+  glGenBuffers(2, particleIdBuffers);
+  glGenBuffers(2, renderPositionBuffers);
+  glGenBuffers(1, &renderVelocityBuffer);
 
   glGenQueries(2 * GPU_PASS_COUNT, &timerQueries[0][0]);
 }
@@ -187,9 +888,53 @@ void shutdownSimulation() {
   glDeleteBuffers(1, &cellStartBuffer);
   glDeleteBuffers(1, &cellEndBuffer);
   glDeleteBuffers(1, &blockSumsBuffer);
+  glDeleteBuffers(1, &brickTableBuffer);
+  glDeleteBuffers(1, &brickScanBuffer);
+  deleteReadbackRing(brickCountRing);
+  deleteReadbackRing(boundsRing);
+  fluidBoundsValid = false;
+  brickTableCapacity = 0;
+  occupiedBricks = -1;
+  glDeleteBuffers(1, &listStateBuffer);
+  glDeleteBuffers(1, &listReferenceBuffer);
+  glDeleteBuffers(1, &listRangesBuffer);
+  glDeleteBuffers(1, &listNeighborsBuffer);
+  deleteReadbackRing(listTotalRing);
+  listParticleCapacity = listCapacity = 0;
+  listsValid = false;
+  if (paramsMapped) {
+    glBindBuffer(GL_UNIFORM_BUFFER, paramsBuffer);
+    glUnmapBuffer(GL_UNIFORM_BUFFER);
+    paramsMapped = nullptr;
+  }
+  glDeleteBuffers(1, &paramsBuffer);
+  for (GLsync &fence : paramsFences) {
+    glDeleteSync(fence);
+    fence = nullptr;
+  }
+  if (statsMapped) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, statsBuffer);
+    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    statsMapped = nullptr;
+  }
+  glDeleteBuffers(1, &statsBuffer);
+  glDeleteBuffers(1, &statsPartialsBuffer);
+  statsPartialsCapacity = 0;
+  for (GLsync &fence : statsFences) {
+    glDeleteSync(fence);
+    fence = nullptr;
+  }
+  glDeleteBuffers(2, particleIdBuffers);
+  glDeleteBuffers(2, renderPositionBuffers);
+  glDeleteBuffers(1, &renderVelocityBuffer);
+  renderStateCapacity = 0;
+  idsTracked = false;
   glDeleteQueries(2 * GPU_PASS_COUNT, &timerQueries[0][0]);
-  for (int i = 0; i < 8; i++)
+  for (int i = 0; i < NUM_COMPUTE_PROGRAMS; i++)
     glDeleteProgram(computeProgram[i]);
+  for (const auto &variant : programVariants)
+    glDeleteProgram(variant.second);
+  programVariants.clear();
 }
 
 void runSimulationFrame() {
@@ -198,9 +943,15 @@ void runSimulationFrame() {
 
   int numWorkGroups = (numParticles + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE;
 
-  // Read the previous frame's timer queries (one frame of latency)
+  // Read the previous step's timer queries (one step of latency). With
+  // several substeps per frame that step may still be running; then keep the
+  // older times rather than stall, and its queries are simply reused.
   int writeSet = (int)(timedFrames & 1);
-  if (timedFrames > 0) {
+  GLuint available = GL_FALSE;
+  if (timedFrames > 0)
+    glGetQueryObjectuiv(timerQueries[writeSet ^ 1][GPU_PASS_COUNT - 1],
+                        GL_QUERY_RESULT_AVAILABLE, &available);
+  if (available) {
     int readSet = writeSet ^ 1;
     for (int i = 0; i < GPU_PASS_COUNT; i++) {
       GLuint64 elapsed = 0;
@@ -211,107 +962,225 @@ void runSimulationFrame() {
   }
   timedFrames++;
 
-  // Dense uniform grid over the world-space AABB of the (possibly rotated)
-  // box, padded by one cell so predicted positions that overshoot the bounds
-  // still land in a border cell. Direct indexing - no hash collisions.
-  glm::vec3 gridMin(FLT_MAX), gridMax(-FLT_MAX);
-  for (int corner = 0; corner < 8; corner++) {
-    glm::vec3 local((corner & 1) ? topX : botX, (corner & 2) ? topY : botY,
-                    (corner & 4) ? topZ : botZ);
-    glm::vec3 world = glm::vec3(boxTransform * glm::vec4(local, 1.0f));
-    gridMin = glm::min(gridMin, world);
-    gridMax = glm::max(gridMax, world);
+  StepParams p = computeStepParams();
+  // Compact positions are stored relative to the box grid's AABB, which
+  // holds every particle even while the grid is fitted to the fluid
+  glm::vec3 boxGridMin = p.gridMin;
+  glm::vec3 boxGridExtent = glm::vec3(p.gridDims) * smoothingRadius;
+
+  // The box-local, fitted and sparse grids are the GPU backend's alone, so
+  // they are applied here rather than in computeStepParams
+  if (boxLocalGrid)
+    setBoxLocalGrid(p);
+  if (fittedGrid && fluidBoundsBoxLocal != boxLocalGrid) {
+    discardReadbacks(boundsRing);
+    fluidBoundsValid = false;
+    fluidBoundsBoxLocal = boxLocalGrid;
   }
-  gridMin -= smoothingRadius;
-  gridMax += smoothingRadius;
-  glm::ivec3 gridDims = glm::max(
-      glm::ivec3(glm::ceil((gridMax - gridMin) / smoothingRadius)),
-      glm::ivec3(1));
-  int cellCount = gridDims.x * gridDims.y * gridDims.z;
-  if (cellCount > gridCellCapacity) {
-    gridCellCapacity = cellCount + cellCount / 2;
+  if (fittedGrid) {
+    pollFluidBounds();
+    if (fluidBoundsValid)
+      fitGridToFluid(p);
+  } else {
+    discardReadbacks(boundsRing);
+    fluidBoundsValid = false;
+  }
+  // The sparse grid's tables cover the occupied bricks (plus the overflow
+  // brick), and rows are no longer contiguous in them. Morton order applies
+  // within each brick, so the grid size does not limit it.
+  glm::ivec3 brickDims = (p.gridDims + BRICK_SIZE - 1) / BRICK_SIZE;
+  int numBricks = brickDims.x * brickDims.y * brickDims.z;
+  int numBrickSlots = 0;
+  if (sparseBrickGrid) {
+    uint32_t count;
+    if (pollReadback(brickCountRing, &count))
+      occupiedBricks = (int)count;
+    numBrickSlots = brickSlots(numBricks);
+    p.cellCount = (numBrickSlots + 1) * BRICK_CELLS;
+    p.mortonOrder = mortonCellOrder;
+    p.rowRanges = p.tiledGather = false;
+    if (numBricks > brickTableCapacity)
+      allocateBrickTable(numBricks);
+  }
+  // The list passes take the place of tiled gathering
+  if (neighborLists)
+    p.tiledGather = false;
+  if (p.cellCount > gridCellCapacity) {
+    gridCellCapacity = p.cellCount + p.cellCount / 2;
     allocateGridBuffers();
   }
-  int numScanBlocks = (cellCount + SCAN_BLOCK - 1) / SCAN_BLOCK;
+  int numScanBlocks = (p.cellCount + SCAN_BLOCK - 1) / SCAN_BLOCK;
 
-  // 3D smoothing kernel normalization factors
-  double h = smoothingRadius;
-  float spikyPow2Scale = (float)(15.0 / (2.0 * M_PI * pow(h, 5)));
-  float spikyPow3Scale = (float)(15.0 / (M_PI * pow(h, 6)));
-  float spikyPow2DerivScale = (float)(-15.0 / (M_PI * pow(h, 5)));
-  float spikyPow3DerivScale = (float)(-45.0 / (M_PI * pow(h, 6)));
-  float poly6Scale = (float)(315.0 / (64.0 * M_PI * pow(h, 9)));
+  // The external pass moves compact positions from last step's box grid
+  // AABB into this step's
+  SimParamsBlock block;
+  block.prevQuantMin = quantMin;
+  block.prevQuantExtent = quantExtent;
+  quantMin = boxGridMin;
+  quantExtent = boxGridExtent;
+  block.quantMin = quantMin;
+  block.quantExtent = quantExtent;
 
-  // Slider calibration: the switch from the old 2D kernel normalization to
-  // proper 3D kernels rescales densities and forces by large, h-dependent
-  // factors. These conversions keep the GUI sliders in the effective range
-  // they were tuned for (and track h, so re-tuning isn't needed when the
-  // smoothing radius slider moves).
-  float targetDensityEff = targetDensity * 12500.0f / smoothingRadius;
-  float pressureStrengthEff = pressureStrength * smoothingRadius;
-  float viscosityStrengthEff = viscosityStrength * 250.0f;
-
-  // External forces (gravity) + predicted positions
-  glBeginQuery(GL_TIME_ELAPSED, timerQueries[writeSet][GPU_PASS_EXTERNAL]);
-  glUseProgram(computeProgram[0]);
-  glUniform1f(externalU.gravity, gravity);
-  glDispatchCompute(numWorkGroups, 1, 1);
-  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-  glEndQuery(GL_TIME_ELAPSED);
+  block.boxTransform = boxTransform;
+  block.boxTransformInverse = boxTransformInverse;
+  block.gridMin = p.gridMin;
+  block.smoothingRadius = smoothingRadius;
+  block.gridDims = p.gridDims;
+  block.numParticles = numParticles;
+  block.deltaTime = simDeltaTime;
+  block.gravity = gravity;
+  block.numCells = p.cellCount;
+  block.numBlocks = numScanBlocks;
+  block.botX = botX;
+  block.botY = botY;
+  block.botZ = botZ;
+  block.topX = topX;
+  block.topY = topY;
+  block.topZ = topZ;
+  block.targetDensity = p.targetDensityEff;
+  block.pressureStrength = p.pressureStrengthEff;
+  block.nearPressureStrength = nearPressureStrength;
+  block.viscosityStrength = p.viscosityStrengthEff;
+  block.spikyPow2Scale = p.spikyPow2Scale;
+  block.spikyPow3Scale = p.spikyPow3Scale;
+  block.poly6Scale = p.poly6Scale;
+  block.spikyPow2DerivScale = p.spikyPow2DerivScale;
+  block.spikyPow3DerivScale = p.spikyPow3DerivScale;
+  block.tileCells = TILE_CELLS;
+  block.mortonOrder = p.mortonOrder;
+  block.rowRanges = p.rowRanges;
+  block.tiled = p.tiledGather;
+  block.stableOrder = deterministicScatter;
+  // IDs are only carried while render interpolation is in use, which needs
+  // real-time stepping; turning it on (or a particle reset) starts them over
+  bool trackIds = renderInterpolation && realTimeStepping;
+  if (!trackIds)
+    idsTracked = false;
+  else if (!idsTracked)
+    startIdTracking();
+  block.trackIds = trackIds;
+  block.sparseGrid = sparseBrickGrid;
+  block.numBrickSlots = numBrickSlots;
+  block.boxLocalGrid = boxLocalGrid;
+  block.brickDims = brickDims;
+  block.numBricks = numBricks;
+  // Neighbor lists over (1 + skin) * h, walking that many cells around each
+  // particle on a rebuild
+  float listRadius = (1.0f + neighborSkin) * smoothingRadius;
+  bool forceListRebuild = false;
+  if (neighborLists)
+    forceListRebuild = prepareNeighborLists(listRadius);
+  else
+    listsValid = false;
+  block.neighborLists = neighborLists;
+  block.forceListRebuild = forceListRebuild;
+  block.listParity = listParity;
+  block.listRadius = listRadius;
+  block.listCapacity = listCapacity;
+  block.listReach = 1 + (int)std::ceil(neighborSkin);
+  uploadSimParams(block);
 
-  // Count particles per cell (cellEnd doubles as the histogram)
-  glBeginQuery(GL_TIME_ELAPSED, timerQueries[writeSet][GPU_PASS_COUNTING]);
   uint32_t zero = 0;
-  glBindBuffer(GL_SHADER_STORAGE_BUFFER, cellEndBuffer);
-  glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER,
-                    GL_UNSIGNED_INT, &zero);
-  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  if (fusedExternalCount && !sparseBrickGrid && !neighborLists) {
+    // External forces and the per-cell count in one dispatch, timed as
+    // External; the Count query is left empty
+    glBeginQuery(GL_TIME_ELAPSED, timerQueries[writeSet][GPU_PASS_EXTERNAL]);
+    clearCellCounts(p.cellCount);
+    if (fittedGrid)
+      beginReadback(boundsRing, 22);
 
-  glUseProgram(computeProgram[3]);
-  glUniform1f(countU.smoothingRadius, smoothingRadius);
-  glUniform3fv(countU.gridMin, 1, &gridMin[0]);
-  glUniform3iv(countU.gridDims, 1, &gridDims[0]);
-  glDispatchCompute(numWorkGroups, 1, 1);
-  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-  glEndQuery(GL_TIME_ELAPSED);
+    glUseProgram(programVariant(11, externalDefines()));
+    glDispatchCompute(numWorkGroups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    if (fittedGrid)
+      endReadback(boundsRing);
+    glEndQuery(GL_TIME_ELAPSED);
+
+    glBeginQuery(GL_TIME_ELAPSED, timerQueries[writeSet][GPU_PASS_COUNTING]);
+    glEndQuery(GL_TIME_ELAPSED);
+  } else {
+    // External forces (gravity) + predicted positions
+    glBeginQuery(GL_TIME_ELAPSED, timerQueries[writeSet][GPU_PASS_EXTERNAL]);
+    if (fittedGrid)
+      beginReadback(boundsRing, 22);
+    glUseProgram(programVariant(0, externalDefines()));
+    glDispatchCompute(numWorkGroups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    if (fittedGrid)
+      endReadback(boundsRing);
+    glEndQuery(GL_TIME_ELAPSED);
+
+    // Count particles per cell (cellEnd doubles as the histogram), in sparse
+    // mode once the occupied bricks have their slots
+    glBeginQuery(GL_TIME_ELAPSED, timerQueries[writeSet][GPU_PASS_COUNTING]);
+    if (sparseBrickGrid)
+      runBrickPasses(numBricks, numWorkGroups);
+    clearCellCounts(p.cellCount);
 
-  // Exclusive prefix sum of the counts -> cellStart, and seed the scatter
-  // cursors (cellEnd) with the same offsets
+    glUseProgram(computeProgram[sharedCountHistogram ? 9 : 3]);
+    glDispatchCompute(numWorkGroups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    glEndQuery(GL_TIME_ELAPSED);
+  }
+
+  // Exclusive prefix sum of the counts -> cellStart, and cellEnd becomes
+  // cellStart + count
   glBeginQuery(GL_TIME_ELAPSED, timerQueries[writeSet][GPU_PASS_SCAN]);
-  glUseProgram(computeProgram[4]);
-  glUniform1i(scanBlocksU.numCells, cellCount);
-  glDispatchCompute(numScanBlocks, 1, 1);
-  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  if (singlePassScan) {
+    // Reset the tile counter and tile states
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, blockSumsBuffer);
+    glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0,
+                         (numScanBlocks + 1) * sizeof(uint32_t),
+                         GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
-  glUseProgram(computeProgram[5]);
-  glUniform1i(scanSumsU.numBlocks, numScanBlocks);
-  glDispatchCompute(1, 1, 1);
-  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    glUseProgram(computeProgram[8]);
+    glDispatchCompute(numScanBlocks, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  } else {
+    glUseProgram(computeProgram[4]);
+    glDispatchCompute(numScanBlocks, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
-  glUseProgram(computeProgram[6]);
-  glUniform1i(scanAddU.numCells, cellCount);
-  glDispatchCompute((cellCount + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
-  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    glUseProgram(computeProgram[5]);
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glUseProgram(computeProgram[6]);
+    glDispatchCompute((p.cellCount + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1,
+                      1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  }
   glEndQuery(GL_TIME_ELAPSED);
 
   // Scatter the particle data into cell order so the neighbor loops below
-  // read contiguous memory. After this pass the scatter cursors in cellEnd
-  // have advanced to each cell's end index.
+  // read contiguous memory. The deterministic variant first lists each
+  // cell's particles, then ranks them by index instead of arrival order.
   glBeginQuery(GL_TIME_ELAPSED, timerQueries[writeSet][GPU_PASS_SCATTER]);
+  if (deterministicScatter) {
+    glUseProgram(computeProgram[10]);
+    glDispatchCompute(numWorkGroups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  }
   glUseProgram(computeProgram[7]);
   glDispatchCompute(numWorkGroups, 1, 1);
   glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  // Neighbor lists of the new order, timed with Scatter; on the steps the
+  // sort was skipped the pass returns at once
+  if (neighborLists) {
+    beginReadback(listTotalRing, 27);
+    glUseProgram(computeProgram[16]);
+    glDispatchCompute(numWorkGroups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT |
+                    GL_BUFFER_UPDATE_BARRIER_BIT);
+    endReadback(listTotalRing);
+  }
   glEndQuery(GL_TIME_ELAPSED);
 
   // Density + near density (sorted space)
   glBeginQuery(GL_TIME_ELAPSED, timerQueries[writeSet][GPU_PASS_DENSITY]);
   glUseProgram(computeProgram[1]);
-  glUniform1f(densityU.smoothingRadius, smoothingRadius);
-  glUniform3fv(densityU.gridMin, 1, &gridMin[0]);
-  glUniform3iv(densityU.gridDims, 1, &gridDims[0]);
-  glUniform1f(densityU.spikyPow2, spikyPow2Scale);
-  glUniform1f(densityU.spikyPow3, spikyPow3Scale);
-  glDispatchCompute(numWorkGroups, 1, 1);
+  dispatchNeighborPass(p, numWorkGroups);
   glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
   glEndQuery(GL_TIME_ELAPSED);
 
@@ -320,27 +1189,179 @@ void runSimulationFrame() {
   // the sorted index: the sorted order simply becomes next frame's particle
   // order, so no back-mapping is needed.
   glBeginQuery(GL_TIME_ELAPSED, timerQueries[writeSet][GPU_PASS_UPDATE]);
-  glUseProgram(computeProgram[2]);
-  glUniform1f(updateU.smoothingRadius, smoothingRadius);
-  glUniform3fv(updateU.gridMin, 1, &gridMin[0]);
-  glUniform3iv(updateU.gridDims, 1, &gridDims[0]);
-  glUniform1f(updateU.targetDensity, targetDensityEff);
-  glUniform1f(updateU.pressureStrength, pressureStrengthEff);
-  glUniform1f(updateU.nearPressureStrength, nearPressureStrength);
-  glUniform1f(updateU.viscosityStrength, viscosityStrengthEff);
-  glUniform1f(updateU.botX, botX);
-  glUniform1f(updateU.botY, botY);
-  glUniform1f(updateU.topX, topX);
-  glUniform1f(updateU.topY, topY);
-  glUniform1f(updateU.botZ, botZ);
-  glUniform1f(updateU.topZ, topZ);
-  glUniform1f(updateU.spikyPow2Derivative, spikyPow2DerivScale);
-  glUniform1f(updateU.spikyPow3Derivative, spikyPow3DerivScale);
-  glUniform1f(updateU.poly6, poly6Scale);
-  glUniformMatrix4fv(updateU.boxTransform, 1, GL_FALSE, &boxTransform[0][0]);
-  glUniformMatrix4fv(updateU.boxTransformInverse, 1, GL_FALSE,
-                     &boxTransformInverse[0][0]);
-  glDispatchCompute(numWorkGroups, 1, 1);
+  glUseProgram(programVariant(2, updateDefines()));
+  dispatchNeighborPass(p, numWorkGroups);
   glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+  // Fluid statistics of this step (also feeding the adaptive timestep),
+  // timed with Update
+  if (fluidStatistics || adaptiveTimestep)
+    runStepStats(numWorkGroups);
+  // Render interpolation state, also timed with Update
+  if (trackIds)
+    runRenderState(numWorkGroups);
   glEndQuery(GL_TIME_ELAPSED);
+
+  if (paramsMapped)
+    paramsFences[paramsSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+  // Collect whatever statistics have arrived by now and pick the next
+  // step's dt from them
+  bool newStats = pollStepStats();
+  if (!adaptiveTimestep)
+    simDeltaTime = fixedDeltaTime;
+  else if (newStats)
+    simDeltaTime = adaptiveDeltaTime();
+}
+
+void GpuSimulation::resetParticles() {
+  idsTracked = false;
+  // The fluid may be anywhere now
+  discardReadbacks(boundsRing);
+  fluidBoundsValid = false;
+  listsValid = false;
+}
+
+bool renderStateBuffers(RenderStateBuffers *buffers) {
+  if (!renderInterpolation || !idsTracked || renderStatesWritten == 0)
+    return false;
+  buffers->positions[0] = renderPositionBuffers[0];
+  buffers->positions[1] = renderPositionBuffers[1];
+  buffers->velocities = renderVelocityBuffer;
+  buffers->newest = renderNewest;
+  buffers->generation = renderStateGeneration;
+  return true;
+}
+
+float renderInterpolationAlpha() {
+  // Paused, the backlog is empty: show the newest state
+  if (!realTimeStepping || !running)
+    return 1.0f;
+  return std::min((float)(simBacklogSeconds / simDeltaTime), 1.0f);
+}
+
+int stepRealTime(SimulationBackend &simulation, double frameSeconds) {
+  if (!running) {
+    simBacklogSeconds = 0.0;
+    lastSubsteps = 0;
+    return 0;
+  }
+  simBacklogSeconds += frameSeconds;
+
+  // Substeps allowed by the budget. Before the first timing (or where the
+  // timers read 0) only the substep cap applies.
+  double stepMs = 0.0;
+  for (int i = 0; i < GPU_PASS_COUNT; i++)
+    stepMs += gpuPassMs[i];
+  int limit = maxSubstepsPerFrame;
+  if (stepMs > 0.0)
+    limit = std::min(limit, std::max(1, (int)(stepBudgetMs / stepMs)));
+
+  // Each step takes the dt simDeltaTime holds when it starts
+  int steps = 0;
+  while (steps < limit && simBacklogSeconds >= simDeltaTime) {
+    simBacklogSeconds -= simDeltaTime;
+    simulation.step();
+    steps++;
+  }
+
+  // Carry at most one full frame of substeps, so a slow machine (or a long
+  // stall) doesn't snowball into ever longer catch-up frames
+  double maxBacklog = maxSubstepsPerFrame * (double)simDeltaTime;
+  if (simBacklogSeconds > maxBacklog) {
+    simDroppedSeconds += simBacklogSeconds - maxBacklog;
+    simBacklogSeconds = maxBacklog;
+  }
+  lastSubsteps = steps;
+  return steps;
+}
+
+SimulationSettings currentSimulationSettings() {
+  SimulationSettings s;
+  s.numParticles = numParticles;
+  s.smoothingRadius = smoothingRadius;
+  s.targetDensity = targetDensity;
+  s.pressureStrength = pressureStrength;
+  s.nearPressureStrength = nearPressureStrength;
+  s.viscosityStrength = viscosityStrength;
+  s.gravity = gravity;
+  s.botX = botX;
+  s.botY = botY;
+  s.topX = topX;
+  s.topY = topY;
+  s.botZ = botZ;
+  s.topZ = topZ;
+  s.boxTransform = boxTransform;
+  s.boxTransformInverse = boxTransformInverse;
+  s.running = running;
+  s.adaptiveTimestep = adaptiveTimestep;
+  s.cflNumber = cflNumber;
+  s.realTimeStepping = realTimeStepping;
+  s.stepBudgetMs = stepBudgetMs;
+  s.maxSubstepsPerFrame = maxSubstepsPerFrame;
+  s.renderInterpolation = renderInterpolation;
+  s.neighborRowRanges = neighborRowRanges;
+  s.tiledNeighborGather = tiledNeighborGather;
+  s.singlePassScan = singlePassScan;
+  s.sharedCountHistogram = sharedCountHistogram;
+  s.deterministicScatter = deterministicScatter;
+  s.mortonCellOrder = mortonCellOrder;
+  s.fusedExternalCount = fusedExternalCount;
+  s.sparseBrickGrid = sparseBrickGrid;
+  s.fittedGrid = fittedGrid;
+  s.boxLocalGrid = boxLocalGrid;
+  s.neighborLists = neighborLists;
+  s.neighborSkin = neighborSkin;
+  s.fluidStatistics = fluidStatistics;
+  return s;
+}
+
+void applySimulationSettings(const SimulationSettings &s) {
+  numParticles = s.numParticles;
+  smoothingRadius = s.smoothingRadius;
+  targetDensity = s.targetDensity;
+  pressureStrength = s.pressureStrength;
+  nearPressureStrength = s.nearPressureStrength;
+  viscosityStrength = s.viscosityStrength;
+  gravity = s.gravity;
+  botX = s.botX;
+  botY = s.botY;
+  topX = s.topX;
+  topY = s.topY;
+  botZ = s.botZ;
+  topZ = s.topZ;
+  boxTransform = s.boxTransform;
+  boxTransformInverse = s.boxTransformInverse;
+  running = s.running;
+  adaptiveTimestep = s.adaptiveTimestep;
+  cflNumber = s.cflNumber;
+  realTimeStepping = s.realTimeStepping;
+  stepBudgetMs = s.stepBudgetMs;
+  maxSubstepsPerFrame = s.maxSubstepsPerFrame;
+  renderInterpolation = s.renderInterpolation;
+  neighborRowRanges = s.neighborRowRanges;
+  tiledNeighborGather = s.tiledNeighborGather;
+  singlePassScan = s.singlePassScan;
+  sharedCountHistogram = s.sharedCountHistogram;
+  deterministicScatter = s.deterministicScatter;
+  mortonCellOrder = s.mortonCellOrder;
+  fusedExternalCount = s.fusedExternalCount;
+  sparseBrickGrid = s.sparseBrickGrid;
+  fittedGrid = s.fittedGrid;
+  boxLocalGrid = s.boxLocalGrid;
+  neighborLists = s.neighborLists;
+  neighborSkin = s.neighborSkin;
+  fluidStatistics = s.fluidStatistics;
+}
+
+SimulationReadout currentSimulationReadout() {
+  SimulationReadout r;
+  r.simDeltaTime = simDeltaTime;
+  r.lastSubsteps = lastSubsteps;
+  r.simBacklogSeconds = simBacklogSeconds;
+  r.simDroppedSeconds = simDroppedSeconds;
+  r.listRebuildRate = listRebuildRate;
+  for (int i = 0; i < GPU_PASS_COUNT; i++)
+    r.gpuPassMs[i] = gpuPassMs[i];
+  r.fluidStats = fluidStats;
+  return r;
 }
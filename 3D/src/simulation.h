@@ -1,5 +1,6 @@
 #pragma once
 #include <GL/glew.h>
+#include <cstdint>
 #include <glm/glm.hpp>
 
 const int WORKGROUP_SIZE = 256;
@@ -10,8 +11,36 @@ const int GRID_CELL_CAPACITY = 32768 * 2 * 2 * 2;
 // Runtime particle count (the counting sort puts no constraints on it)
 extern int numParticles;
 extern int pendingNumParticles; // edited by the GUI, applied between frames
+// Particle counts offered by the GUI and swept by sph_bench
+const int particleCountPresets[] = {16384,  32768,  65536,  131072,
+                                    262144, 524288, 1048576};
+const int NUM_PARTICLE_COUNT_PRESETS = 7;
 
 extern const float fixedDeltaTime;
+// Adaptive timestep (GPU backend): the next dt is the CFL bound on the
+// latest fluidStats, with v its max speed and a its max acceleration:
+// cflNumber * min(h / v, sqrt(h / a)), clamped to [fixedDeltaTime / 4,
+// 2 * fixedDeltaTime] and grown by at most 10% per step. simDeltaTime is
+// the dt of the next step: fixedDeltaTime unless adaptive.
+extern bool adaptiveTimestep;
+extern float cflNumber;
+extern float simDeltaTime;
+
+// Fluid statistics (GPU backend): a reduction pass after update
+// (step_stats.compute) aggregates the step into a small buffer, read back
+// without stalling once its fence has signaled, a step or more later. Runs
+// while fluidStatistics or adaptiveTimestep is on.
+struct FluidStats {
+  bool valid; // false until the first readback
+  float maxSpeed, maxAcceleration;
+  float kineticEnergy; // 0.5 * sum |v|^2, unit particle mass
+  // |density / target - 1| over the particles (the target as the solver
+  // uses it, after slider calibration)
+  float meanDensityError, maxDensityError;
+  glm::vec3 boundsMin, boundsMax; // particle AABB
+};
+extern bool fluidStatistics;
+extern FluidStats fluidStats;
 extern float smoothingRadius;
 extern float targetDensity;
 extern float pressureStrength;
@@ -19,10 +48,76 @@ extern float nearPressureStrength;
 extern float viscosityStrength;
 extern float gravity;
 extern float botX, botY, topX, topY, botZ, topZ;
-extern GLuint computeProgram[8];
+// Neighbor walk: 9 contiguous x-row ranges (default) or 27 single cells
+extern bool neighborRowRanges;
+// Density/update: one workgroup per block of x-adjacent cells, staging the
+// block's neighbor rows through shared memory (tiles.glsl) instead of one
+// thread per particle reading them from global memory. Row-major cell order
+// only; the GPU backend's passes only. Tests twice the candidates and is far
+// slower on llvmpipe (see tiles.glsl); no device where it wins is known.
+extern bool tiledNeighborGather;
+// Scan: single-pass decoupled look-back (default) or the three-pass
+// scan_blocks/scan_sums/scan_add chain
+extern bool singlePassScan;
+// Count: aggregate each workgroup's cells in shared memory before the global
+// atomics (count_shared) instead of one global atomic per particle
+extern bool sharedCountHistogram;
+// Scatter: order particles within a cell by index rather than by arrival at
+// the count atomics, making runs reproducible bit for bit (one extra pass)
+extern bool deterministicScatter;
+// Cell numbering: Morton / Z-order instead of row-major. Row neighbor ranges
+// need row-major order and are skipped while this is on.
+extern bool mortonCellOrder;
+// External + count: one fused dispatch (external_count, timed as External)
+// instead of two. The fused pass always counts with global atomics, and is
+// skipped in sparse grid mode, which needs every position before the count,
+// and with neighbor lists, which decide whether to count at all only once
+// the whole external pass has run.
+extern bool fusedExternalCount;
+// Sparse grid: cell table entries only for the bricks of 8^3 cells that hold
+// particles (see common.glsl), so table memory and scan time follow the
+// fluid volume rather than the box volume. The bricks are found and numbered
+// by two passes before the count (timed with Count). Walks 27 cells, like
+// Morton mode; the GPU backend's passes only.
+extern bool sparseBrickGrid;
+// Fitted grid: the external pass also reduces the AABB of the predicted
+// positions, and later steps grid only the box grid's cells around the
+// latest one read back (a step or more old), widened by a two-cell margin.
+// A fluid filling a fraction of a large box then costs no clearing or
+// scanning for the empty rest. GPU backend only.
+extern bool fittedGrid;
+// Box-local grid: particles are binned in the box's own frame (through
+// boxTransformInverse) over the box's padded extents, so rotating the box
+// changes neither the cell count nor the table sizes. In world space the
+// grid covers the rotated box's AABB: twice the cells of a box with a square
+// footprint at 45 degrees. GPU backend only.
+extern bool boxLocalGrid;
+// Verlet neighbor lists (see lists.glsl): after each cell sort, a pass lists
+// every particle's neighbors within (1 + neighborSkin) * h, and density and
+// update loop over those lists. While no particle has moved more than half
+// the skin since, the GPU skips the sort and the rebuild altogether. Tiled
+// gathering and the fused external + count pass are off in this mode. GPU
+// backend only.
+extern bool neighborLists;
+extern float neighborSkin; // in smoothing radii
+// Share of recent steps that rebuilt the lists, from readbacks
+extern float listRebuildRate;
+// Compact particle storage: 16-bit fixed-point positions and half-float
+// velocities (COMPACT_PARTICLES in the shaders, see particles.glsl). Fixed
+// at startup, since it changes the shaders and the particle buffer layout;
+// GPU backend only.
+extern bool compactParticles;
+// Grid AABB the compact positions are currently stored relative to: that of
+// the last step, or of createParticleBuffers before the first one
+extern glm::vec3 quantMin, quantExtent;
+const int NUM_COMPUTE_PROGRAMS = 17;
+extern GLuint computeProgram[NUM_COMPUTE_PROGRAMS];
 extern bool running;
+extern glm::mat4 boxTransform;
+extern glm::mat4 boxTransformInverse;
 
-// Per-pass GPU times of the previous simulation step (GL_TIME_ELAPSED)
+// Per-pass times of the previous simulation step (GL_TIME_ELAPSED on the GPU
+// backend, wall clock on the CPU backend)
 enum {
   GPU_PASS_EXTERNAL,
   GPU_PASS_COUNTING,
@@ -35,7 +130,122 @@ enum {
 extern const char *gpuPassNames[GPU_PASS_COUNT];
 extern double gpuPassMs[GPU_PASS_COUNT];
 
+// Quantities derived from the parameters above once per step: the dense
+// grid over the box and the kernel/slider scaling factors. Every backend
+// uses these, so they all integrate the same equations on the same grid.
+struct StepParams {
+  glm::vec3 gridMin;
+  glm::ivec3 gridDims;
+  int cellCount; // size of the cell tables (> cell count in Morton mode)
+  bool mortonOrder, rowRanges; // effective cell numbering / neighbor walk
+  bool tiledGather;            // effective tiledNeighborGather
+  float spikyPow2Scale, spikyPow3Scale;
+  float spikyPow2DerivScale, spikyPow3DerivScale, poly6Scale;
+  float targetDensityEff, pressureStrengthEff, viscosityStrengthEff;
+};
+StepParams computeStepParams();
+// Morton index of a cell, as GetFlatCellIndex in common.glsl (10 bits/axis)
+uint32_t MortonCellIndex(const glm::ivec3 &cellCoord);
+
 void setupComputeShaders();
 void runSimulationFrame();
-void updateNumParticlesUniform();
 void shutdownSimulation();
+
+// A simulation backend advances the particle state by one simDeltaTime step
+// per call, running the passes in gpuPassNames and reporting their times in
+// gpuPassMs. main.cpp picks one at startup.
+class SimulationBackend {
+public:
+  virtual ~SimulationBackend() = default;
+  virtual const char *name() const = 0;
+  // Called after the particle buffers were (re)created, respawned or resized
+  virtual void resetParticles() = 0;
+  virtual void step() = 0;
+};
+
+// The compute-shader pipeline above (needs a GL 4.3 context)
+class GpuSimulation : public SimulationBackend {
+public:
+  GpuSimulation() { setupComputeShaders(); }
+  ~GpuSimulation() override { shutdownSimulation(); }
+  const char *name() const override { return "GPU"; }
+  // numParticles goes to the shaders with every step's SimParams; only the
+  // render interpolation state depends on the particle buffers
+  void resetParticles() override;
+  void step() override { runSimulationFrame(); }
+};
+
+// Real-time stepping: the main loop adds each frame's wall time to a backlog
+// and runs as many simDeltaTime substeps as the backlog holds, at most
+// maxSubstepsPerFrame and as many as fit in stepBudgetMs at the last measured
+// step time (the gpuPassMs total). The rest carries over to the next frame,
+// up to maxSubstepsPerFrame steps' worth; anything beyond that is dropped
+// for good. Off: exactly one step per frame, so sim speed follows the
+// framerate.
+extern bool realTimeStepping;
+extern float stepBudgetMs;
+extern int maxSubstepsPerFrame;
+// Last frame's substep count, the simulated time still owed to wall time,
+// and the total simulated time dropped so far
+extern int lastSubsteps;
+extern double simBacklogSeconds, simDroppedSeconds;
+// Runs this frame's substeps on simulation; returns how many
+int stepRealTime(SimulationBackend &simulation, double frameSeconds);
+
+// Render interpolation (GPU backend, with real-time stepping): the scatter
+// pass carries a persistent ID per particle through the cell sort, and after
+// every step render_state.compute writes the particles at their ID into the
+// newer of two position buffers. The renderer blends the last two steps by
+// the fraction of a step left in the backlog, drawing one step behind but
+// smoothly at any framerate.
+extern bool renderInterpolation;
+struct RenderStateBuffers {
+  GLuint positions[2]; // vec4 per particle ID; positions[newest] is newer
+  GLuint velocities;   // of the newer step
+  int newest;
+  int generation; // changes whenever the buffers are recreated
+};
+// false until a step has written the state (always on the CPU backend)
+bool renderStateBuffers(RenderStateBuffers *buffers);
+// Weight of the newer state: 1 without real-time stepping
+float renderInterpolationAlpha();
+
+// Everything the GUI and input edit that a step reads. The main thread edits
+// its own copy and applies it before stepping, or hands it to the
+// simulation thread (see sim_thread.h), which applies it between its steps;
+// either way a step never sees these change under it.
+struct SimulationSettings {
+  int numParticles;
+  float smoothingRadius, targetDensity, pressureStrength, nearPressureStrength,
+      viscosityStrength, gravity;
+  float botX, botY, topX, topY, botZ, topZ;
+  glm::mat4 boxTransform, boxTransformInverse;
+  bool running;
+  bool adaptiveTimestep;
+  float cflNumber;
+  bool realTimeStepping;
+  float stepBudgetMs;
+  int maxSubstepsPerFrame;
+  bool renderInterpolation;
+  bool neighborRowRanges, tiledNeighborGather, singlePassScan,
+      sharedCountHistogram, deterministicScatter, mortonCellOrder,
+      fusedExternalCount, sparseBrickGrid, fittedGrid, boxLocalGrid;
+  bool neighborLists;
+  float neighborSkin;
+  bool fluidStatistics;
+};
+SimulationSettings currentSimulationSettings();
+// Copies the settings into the globals above. A changed numParticles needs
+// the particle buffers resized before the next step.
+void applySimulationSettings(const SimulationSettings &settings);
+
+// What the last steps leave for the GUI to show
+struct SimulationReadout {
+  float simDeltaTime;
+  int lastSubsteps;
+  double simBacklogSeconds, simDroppedSeconds;
+  float listRebuildRate;
+  double gpuPassMs[GPU_PASS_COUNT];
+  FluidStats fluidStats;
+};
+SimulationReadout currentSimulationReadout();
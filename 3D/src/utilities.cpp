@@ -1,4 +1,6 @@
 #include "utilities.h"
+#include "shader.h"
+#include <algorithm>
 #include <random>
 
 std::vector<glm::vec2> quadVertices = {
@@ -17,57 +19,178 @@ std::vector<glm::vec3> cubeVertices = {
 std::vector<unsigned int> cubeIndices = {0, 1, 1, 2, 2, 3, 3, 0, 4, 5, 5, 6,
                                          6, 7, 7, 4, 0, 4, 1, 5, 2, 6, 3, 7};
 
-glm::vec4 genRandomVector3d() {
-  static std::mt19937 gen{std::random_device{}()};
-  std::uniform_real_distribution<float> dist_x(((botX + 0.00f * (topX - botX))),
-                                               (botX + 0.60f * (topX - botX)));
-  std::uniform_real_distribution<float> dist_y(((botY + 0.30f * (topY - botY))),
-                                               (botY + 0.70f * (topY - botY)));
-  std::uniform_real_distribution<float> dist_z(((botZ + 0.20f * (topZ - botZ))),
-                                               (botZ + 0.80f * (topZ - botZ)));
-  return glm::vec4(dist_x(gen), dist_y(gen), dist_z(gen), 0.0f);
+namespace {
+// Particles spawn at rest in this part of the box
+void spawnRegion(glm::vec3 *lo, glm::vec3 *hi) {
+  *lo = glm::vec3(botX + 0.00f * (topX - botX), botY + 0.30f * (topY - botY),
+                  botZ + 0.20f * (topZ - botZ));
+  *hi = glm::vec3(botX + 0.60f * (topX - botX), botY + 0.70f * (topY - botY),
+                  botZ + 0.80f * (topZ - botZ));
 }
 
-namespace {
-void createStorageBuffer(GLuint *buffer, GLuint binding, GLsizeiptr size,
-                         const void *data) {
+// Seed of the GPU spawns. Fixed at launch, so runs are reproducible, and
+// bumped by every spawn, so a reset draws a different fluid.
+uint32_t spawnSeed = 1;
+
+void createStorageBuffer(GLuint *buffer, GLuint binding, GLsizeiptr size) {
   glGenBuffers(1, buffer);
   glBindBuffer(GL_SHADER_STORAGE_BUFFER, *buffer);
-  glBufferData(GL_SHADER_STORAGE_BUFFER, size, data, GL_DYNAMIC_COPY);
+  // Immutable storage where available. The CPU backend uploads its state
+  // with glBufferSubData, hence the dynamic bit.
+  if (GLEW_ARB_buffer_storage)
+    glBufferStorage(GL_SHADER_STORAGE_BUFFER, size, nullptr,
+                    GL_DYNAMIC_STORAGE_BIT);
+  else
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, nullptr, GL_DYNAMIC_COPY);
   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, *buffer);
 }
-} // namespace
 
-void createParticleBuffers(ParticleBuffers *buffers) {
-  std::vector<glm::vec4> positions(numParticles);
-  std::vector<glm::vec4> velocities(numParticles, glm::vec4(0.0f));
-  std::vector<float> zeros(numParticles, 0.0f);
-  for (int i = 0; i < numParticles; ++i)
-    positions[i] = genRandomVector3d();
-
-  GLsizeiptr vec4Size = numParticles * sizeof(glm::vec4);
-  GLsizeiptr uintSize = numParticles * sizeof(uint32_t);
-  GLsizeiptr floatSize = numParticles * sizeof(float);
-
-  createStorageBuffer(&buffers->positions, 0, vec4Size, positions.data());
-  createStorageBuffer(&buffers->velocities, 1, vec4Size, velocities.data());
-  createStorageBuffer(&buffers->densities, 2, floatSize, zeros.data());
+void createStorageBuffers(ParticleBuffers *buffers, int capacity) {
+  GLsizeiptr attribSize = particleAttribBytes(capacity);
+  GLsizeiptr uintSize = capacity * sizeof(uint32_t);
+  GLsizeiptr floatSize = capacity * sizeof(float);
+  createStorageBuffer(&buffers->positions, 0, attribSize);
+  createStorageBuffer(&buffers->velocities, 1, attribSize);
+  createStorageBuffer(&buffers->densities, 2, floatSize);
   // overwritten by the external-forces pass before first use
-  createStorageBuffer(&buffers->predicted, 3, vec4Size, positions.data());
-  createStorageBuffer(&buffers->cellIndices, 4, uintSize, nullptr);
-  createStorageBuffer(&buffers->sortedPredicted, 5, vec4Size, nullptr);
-  createStorageBuffer(&buffers->nearDensities, 7, floatSize, zeros.data());
-  createStorageBuffer(&buffers->sortedPositions, 9, vec4Size, nullptr);
-  createStorageBuffer(&buffers->sortedVelocities, 10, vec4Size, nullptr);
+  createStorageBuffer(&buffers->predicted, 3, attribSize);
+  createStorageBuffer(&buffers->cellIndices, 4, uintSize);
+  createStorageBuffer(&buffers->sortedPredicted, 5, attribSize);
+  createStorageBuffer(&buffers->nearDensities, 7, floatSize);
+  createStorageBuffer(&buffers->sortedPositions, 9, attribSize);
+  createStorageBuffer(&buffers->sortedVelocities, 10, attribSize);
+  createStorageBuffer(&buffers->cellRanks, 12, uintSize);
+  createStorageBuffer(&buffers->cellParticleIds, 13, uintSize);
+  buffers->capacity = capacity;
 }
 
-void deleteParticleBuffers(ParticleBuffers *buffers) {
+void deleteStorageBuffers(const ParticleBuffers *buffers) {
   GLuint ids[] = {buffers->positions,       buffers->velocities,
                   buffers->densities,       buffers->predicted,
                   buffers->cellIndices,     buffers->sortedPredicted,
                   buffers->nearDensities,   buffers->sortedPositions,
-                  buffers->sortedVelocities};
-  glDeleteBuffers(9, ids);
+                  buffers->sortedVelocities, buffers->cellRanks,
+                  buffers->cellParticleIds};
+  glDeleteBuffers(11, ids);
+}
+
+void copyBuffer(GLuint src, GLuint dst, GLsizeiptr size) {
+  glBindBuffer(GL_COPY_READ_BUFFER, src);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, dst);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size);
+}
+
+// Reallocates every buffer at the new capacity, carrying over the first
+// `kept` positions and velocities; the rest is per-step scratch
+void growStorageBuffers(ParticleBuffers *buffers, int capacity, int kept) {
+  ParticleBuffers old = *buffers;
+  createStorageBuffers(buffers, capacity);
+  if (kept > 0) {
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    copyBuffer(old.positions, buffers->positions, particleAttribBytes(kept));
+    copyBuffer(old.velocities, buffers->velocities, particleAttribBytes(kept));
+  }
+  deleteStorageBuffers(&old);
+}
+
+// Spawns particles [first, end) in the current quantMin/quantExtent frame
+void spawnParticles(const ParticleBuffers *buffers, int first, int end) {
+  if (end <= first)
+    return;
+  glm::vec3 lo, hi;
+  spawnRegion(&lo, &hi);
+  GLuint program = buffers->spawnProgram;
+  glUseProgram(program);
+  glUniform1ui(glGetUniformLocation(program, "firstParticle"), first);
+  glUniform1ui(glGetUniformLocation(program, "endParticle"), end);
+  glUniform1ui(glGetUniformLocation(program, "seed"), spawnSeed++);
+  glUniform3fv(glGetUniformLocation(program, "spawnMin"), 1, &lo[0]);
+  glUniform3fv(glGetUniformLocation(program, "spawnMax"), 1, &hi[0]);
+  glUniform3fv(glGetUniformLocation(program, "quantMin"), 1, &quantMin[0]);
+  glUniform3fv(glGetUniformLocation(program, "quantExtent"), 1,
+               &quantExtent[0]);
+  glDispatchCompute((end - first + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT |
+                  GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT |
+                  GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+// Keeps newCount of the first oldCount particles, evenly spread
+void thinParticles(const ParticleBuffers *buffers, int oldCount,
+                   int newCount) {
+  GLuint program = buffers->thinProgram;
+  glUseProgram(program);
+  glUniform1ui(glGetUniformLocation(program, "oldCount"), oldCount);
+  glUniform1ui(glGetUniformLocation(program, "newCount"), newCount);
+  glDispatchCompute((oldCount + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+  // The survivors are in the sorted buffers; copy them back
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+  copyBuffer(buffers->sortedPositions, buffers->positions,
+             particleAttribBytes(newCount));
+  copyBuffer(buffers->sortedVelocities, buffers->velocities,
+             particleAttribBytes(newCount));
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT |
+                  GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
+} // namespace
+
+glm::vec4 genRandomVector3d() {
+  static std::mt19937 gen{std::random_device{}()};
+  glm::vec3 lo, hi;
+  spawnRegion(&lo, &hi);
+  std::uniform_real_distribution<float> dist_x(lo.x, hi.x);
+  std::uniform_real_distribution<float> dist_y(lo.y, hi.y);
+  std::uniform_real_distribution<float> dist_z(lo.z, hi.z);
+  return glm::vec4(dist_x(gen), dist_y(gen), dist_z(gen), 0.0f);
+}
+
+GLsizeiptr particleAttribBytes(int count) {
+  // Compact: 16-bit unorm xyz + padding, half-float velocities
+  if (compactParticles)
+    return (GLsizeiptr)count * 4 * sizeof(uint16_t);
+  return (GLsizeiptr)count * sizeof(glm::vec4);
+}
+
+void createParticleBuffers(ParticleBuffers *buffers) {
+  *buffers = {};
+  buffers->spawnProgram =
+      submitComputeProgram(spawnParticlesShaderSource, "SPAWN PARTICLES");
+  buffers->thinProgram =
+      submitComputeProgram(thinParticlesShaderSource, "THIN PARTICLES");
+  finishProgram(buffers->spawnProgram);
+  finishProgram(buffers->thinProgram);
+  resizeParticleBuffers(buffers, true);
+}
+
+void resizeParticleBuffers(ParticleBuffers *buffers, bool respawn) {
+  int kept = respawn ? 0 : std::min(buffers->count, numParticles);
+  if (numParticles > buffers->capacity) {
+    // Headroom after the first allocation, so raising the count step by
+    // step does not reallocate every time
+    int capacity = buffers->capacity == 0
+                       ? std::max(numParticles, 1)
+                       : numParticles + numParticles / 2;
+    growStorageBuffers(buffers, capacity, kept);
+  }
+  if (!respawn && numParticles < buffers->count)
+    thinParticles(buffers, buffers->count, numParticles);
+
+  // Compact positions are stored relative to the grid AABB: a fresh fluid
+  // starts in the current one, added particles join the frame of the rest
+  if (respawn && compactParticles) {
+    StepParams p = computeStepParams();
+    quantMin = p.gridMin;
+    quantExtent = glm::vec3(p.gridDims) * smoothingRadius;
+  }
+  spawnParticles(buffers, kept, numParticles);
+  buffers->count = numParticles;
+}
+
+void deleteParticleBuffers(ParticleBuffers *buffers) {
+  deleteStorageBuffers(buffers);
+  glDeleteProgram(buffers->spawnProgram);
+  glDeleteProgram(buffers->thinProgram);
+  *buffers = {};
 }
 
 void setupCubeBuffers(GLuint *cubeVAO, GLuint *cubeVBO, GLuint *cubeEBO) {
@@ -112,12 +235,14 @@ void setupFloorBuffers(GLuint *floorVAO, GLuint *floorVBO) {
   glBindVertexArray(0);
 }
 
-void updateCubeBounds(GLuint cubeVBO) {
+void updateCubeBounds(GLuint cubeVBO, const glm::vec3 &boxMin,
+                      const glm::vec3 &boxMax) {
+  const glm::vec3 &b = boxMin, &t = boxMax;
   std::vector<glm::vec3> newCubeVertices = {
-      glm::vec3(botX, botY, botZ), glm::vec3(topX, botY, botZ),
-      glm::vec3(topX, botY, topZ), glm::vec3(botX, botY, topZ),
-      glm::vec3(botX, topY, botZ), glm::vec3(topX, topY, botZ),
-      glm::vec3(topX, topY, topZ), glm::vec3(botX, topY, topZ)};
+      glm::vec3(b.x, b.y, b.z), glm::vec3(t.x, b.y, b.z),
+      glm::vec3(t.x, b.y, t.z), glm::vec3(b.x, b.y, t.z),
+      glm::vec3(b.x, t.y, b.z), glm::vec3(t.x, t.y, b.z),
+      glm::vec3(t.x, t.y, t.z), glm::vec3(b.x, t.y, t.z)};
 
   glBindBuffer(GL_ARRAY_BUFFER, cubeVBO);
   glBufferSubData(GL_ARRAY_BUFFER, 0,
@@ -125,8 +250,8 @@ void updateCubeBounds(GLuint cubeVBO) {
                   &newCubeVertices[0]);
 }
 
-void setupQuadBuffers(GLuint *quadVAO, GLuint *quadVBO, GLuint posBuffer,
-                      GLuint velBuffer) {
+namespace {
+void setupQuadVertices(GLuint *quadVAO, GLuint *quadVBO) {
   glGenVertexArrays(1, quadVAO);
   glGenBuffers(1, quadVBO);
 
@@ -139,16 +264,50 @@ void setupQuadBuffers(GLuint *quadVAO, GLuint *quadVBO, GLuint posBuffer,
   glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), (void *)0);
   glEnableVertexAttribArray(0);
   glVertexAttribDivisor(0, 0); // Per vertex
+}
+} // namespace
 
-  // Instance data - positions (per instance)
+void setupQuadBuffers(GLuint *quadVAO, GLuint *quadVBO, GLuint posBuffer,
+                      GLuint velBuffer) {
+  setupQuadVertices(quadVAO, quadVBO);
+
+  // Instance data - positions (per instance). Compact positions are
+  // normalized ushort4, mapped onto the grid AABB in particle.vs.
   glBindBuffer(GL_ARRAY_BUFFER, posBuffer);
-  glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), (void *)0);
+  if (compactParticles)
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_SHORT, GL_TRUE,
+                          4 * sizeof(uint16_t), (void *)0);
+  else
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4),
+                          (void *)0);
   glEnableVertexAttribArray(1);
   glVertexAttribDivisor(1, 1); // Per instance
 
-  // Instance data - velocities (per instance)
+  // Instance data - velocities (per instance), half4 when compact
   glBindBuffer(GL_ARRAY_BUFFER, velBuffer);
-  glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), (void *)0);
+  if (compactParticles)
+    glVertexAttribPointer(2, 4, GL_HALF_FLOAT, GL_FALSE, 4 * sizeof(uint16_t),
+                          (void *)0);
+  else
+    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4),
+                          (void *)0);
   glEnableVertexAttribArray(2);
   glVertexAttribDivisor(2, 1); // Per instance
 }
+
+void setupInterpolatedQuadBuffers(GLuint *quadVAO, GLuint *quadVBO,
+                                  GLuint prevPosBuffer, GLuint posBuffer,
+                                  GLuint velBuffer) {
+  setupQuadVertices(quadVAO, quadVBO);
+
+  // Instance data - position, velocity and previous position, all vec4 (the
+  // render state is unpacked even with compact storage)
+  GLuint instanceBuffers[] = {posBuffer, velBuffer, prevPosBuffer};
+  for (GLuint i = 0; i < 3; i++) {
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffers[i]);
+    glVertexAttribPointer(1 + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4),
+                          (void *)0);
+    glEnableVertexAttribArray(1 + i);
+    glVertexAttribDivisor(1 + i, 1); // Per instance
+  }
+}
@@ -6,7 +6,9 @@
 
 // All per-particle SSBOs. positions/velocities hold the current state (and
 // feed instanced rendering); the sorted* buffers are the cell-ordered copies
-// produced by the scatter pass each frame.
+// produced by the scatter pass each frame. The buffers hold `capacity`
+// particles, of which the first `count` are live; they only grow. Also holds
+// the programs that spawn and thin particles in them.
 struct ParticleBuffers {
   GLuint positions;         // binding 0
   GLuint velocities;        // binding 1
@@ -17,15 +19,35 @@ struct ParticleBuffers {
   GLuint nearDensities;     // binding 7
   GLuint sortedPositions;   // binding 9
   GLuint sortedVelocities;  // binding 10
+  GLuint cellRanks;         // binding 12
+  GLuint cellParticleIds;   // binding 13
+  int capacity;
+  int count;
+  GLuint spawnProgram;
+  GLuint thinProgram;
 };
 
+// Random point in the spawn region (CPU side; the GPU spawns its own)
 glm::vec4 genRandomVector3d();
-// Generates initial particle data for the current `numParticles` and
-// (re)creates the particle SSBOs
+// Bytes of one position or velocity array for `count` particles
+GLsizeiptr particleAttribBytes(int count);
+// Creates the particle SSBOs for the current `numParticles` and spawns the
+// particles on the GPU
 void createParticleBuffers(ParticleBuffers *buffers);
+// Brings the buffers to the current `numParticles` in place, reallocating
+// only when it exceeds the capacity. respawn: spawn every particle anew (a
+// reset). Otherwise the live particles keep their state: growing spawns the
+// new ones, shrinking keeps an evenly spread subset.
+void resizeParticleBuffers(ParticleBuffers *buffers, bool respawn);
 void deleteParticleBuffers(ParticleBuffers *buffers);
 void setupCubeBuffers(GLuint *cubeVAO, GLuint *cubeVBO, GLuint *cubeEBO);
 void setupFloorBuffers(GLuint *floorVAO, GLuint *floorVBO);
 void setupQuadBuffers(GLuint *quadVAO, GLuint *quadVBO, GLuint posBuffer,
                       GLuint velBuffer);
-void updateCubeBounds(GLuint cubeVBO);
+// Quad VAO over the render interpolation state (see renderStateBuffers),
+// with the previous positions at attribute 3
+void setupInterpolatedQuadBuffers(GLuint *quadVAO, GLuint *quadVBO,
+                                  GLuint prevPosBuffer, GLuint posBuffer,
+                                  GLuint velBuffer);
+void updateCubeBounds(GLuint cubeVBO, const glm::vec3 &boxMin,
+                      const glm::vec3 &boxMax);
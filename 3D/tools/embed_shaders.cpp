@@ -0,0 +1,104 @@
+// Build-time generator for the embedded shader sources (see
+// src/embedded_shaders.h):
+//   embed_shaders <output.cpp> <root dir> <shader path>...
+// Each shader path is relative to the root dir, as in shader.h. Its
+// #include "file" lines are expanded the same way shader.cpp expands them
+// (one level, relative to the shader's directory); the runtime defines are
+// still injected when the program is built.
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace {
+
+// Raw string delimiter of the generated literals
+const std::string DELIMITER = "glsl";
+
+bool LoadFile(const std::filesystem::path &path, std::string *text) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    std::cerr << "embed_shaders: could not open " << path.string()
+              << std::endl;
+    return false;
+  }
+  std::stringstream stream;
+  stream << file.rdbuf();
+  *text = stream.str();
+  return true;
+}
+
+bool ExpandIncludes(const std::filesystem::path &path, std::string *text) {
+  std::string source;
+  if (!LoadFile(path, &source))
+    return false;
+  std::istringstream input(source);
+  std::ostringstream output;
+  std::string line;
+  while (std::getline(input, line)) {
+    if (line.rfind("#include", 0) == 0) {
+      size_t first = line.find('"');
+      size_t last = line.rfind('"');
+      std::string included;
+      if (!LoadFile(path.parent_path() /
+                        line.substr(first + 1, last - first - 1),
+                    &included))
+        return false;
+      output << included << '\n';
+    } else {
+      output << line << '\n';
+    }
+  }
+  *text = output.str();
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cerr << "usage: embed_shaders <output.cpp> <root dir> <shader>..."
+              << std::endl;
+    return 1;
+  }
+  std::filesystem::path root = argv[2];
+
+  std::ostringstream out;
+  out << "// Generated by tools/embed_shaders.cpp. Do not edit.\n"
+      << "#include \"src/embedded_shaders.h\"\n\n"
+      << "namespace {\n\n"
+      << "struct EmbeddedShader {\n"
+      << "  const char *path;\n"
+      << "  const char *source;\n"
+      << "};\n\n"
+      << "const EmbeddedShader EMBEDDED_SHADERS[] = {\n";
+  for (int i = 3; i < argc; i++) {
+    std::string text;
+    if (!ExpandIncludes(root / argv[i], &text))
+      return 1;
+    if (text.find(")" + DELIMITER + "\"") != std::string::npos) {
+      std::cerr << "embed_shaders: " << argv[i]
+                << " contains the raw string delimiter" << std::endl;
+      return 1;
+    }
+    out << "    {\"" << argv[i] << "\", R\"" << DELIMITER << "(" << text
+        << ")" << DELIMITER << "\"},\n";
+  }
+  out << "};\n\n"
+      << "} // namespace\n\n"
+      << "const char *embeddedShaderSource(const std::string &path) {\n"
+      << "  for (const EmbeddedShader &shader : EMBEDDED_SHADERS)\n"
+      << "    if (path == shader.path)\n"
+      << "      return shader.source;\n"
+      << "  return nullptr;\n"
+      << "}\n";
+
+  std::ofstream file(argv[1], std::ios::trunc);
+  file << out.str();
+  if (!file) {
+    std::cerr << "embed_shaders: could not write " << argv[1] << std::endl;
+    return 1;
+  }
+  return 0;
+}